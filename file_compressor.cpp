@@ -2,22 +2,54 @@
 
 #include <iostream>
 #include <fstream>
-#include <queue>
-#include <unordered_map>
+#include <deque>
 #include <bitset>
 #include <vector>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <chrono>
 #include <iomanip>
+#include <sstream>
 #include <algorithm>
+#include <iterator>
+#include <numeric>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
 #include <cmath>
+#include <random>
+#include <cstdint>
+#include <cstring>
+// GCC and Clang on x86-64 compile kernels for SSE4.2 or BMI2 alongside the
+// baseline ones and pick between them at runtime
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define FC_X86_TARGETS 1
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define FC_ALWAYS_INLINE inline __attribute__((always_inline))
+#define FC_UNROLL_STREAMS _Pragma("GCC unroll 4")
+#else
+#define FC_ALWAYS_INLINE inline
+#define FC_UNROLL_STREAMS
+#endif
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
 #include <sys/stat.h>
 #ifdef _WIN32
 #include <direct.h>
 #else
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
@@ -44,6 +76,112 @@ bool createDirectory(const string& path) {
 #endif
 }
 
+// Creates the directories leading to path, which may already exist
+void createParentDirectories(const string& path) {
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1)) {
+        createDirectory(path.substr(0, slash));
+    }
+}
+
+// Read-only mapping of a whole file. open() fails where mmap is unavailable
+// and for empty or special files; callers then use their stream path.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+    
+    bool open(const string& filename) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+                base = static_cast<const uint8_t*>(p);
+                length = (size_t)st.st_size;
+            }
+        }
+        ::close(fd);
+#endif
+        return base != nullptr;
+    }
+    
+    void close() {
+#ifndef _WIN32
+        if (base) munmap(const_cast<uint8_t*>(base), length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+    
+    const uint8_t* data() const { return base; }
+    size_t size() const { return length; }
+    
+private:
+    const uint8_t* base = nullptr;
+    size_t length = 0;
+};
+
+// Seekable istream buffer over memory, so the stream-based decoders can run
+// on a mapped file without going through the filesystem again
+class MemoryBuf : public streambuf {
+public:
+    MemoryBuf(const uint8_t* data, size_t size) {
+        char* p = const_cast<char*>(reinterpret_cast<const char*>(data));
+        setg(p, p, p + size);
+    }
+    
+protected:
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode) override {
+        char* origin = dir == ios_base::beg ? eback() : dir == ios_base::cur ? gptr() : egptr();
+        if (off < eback() - origin || off > egptr() - origin) return pos_type(off_type(-1));
+        setg(eback(), origin + off, egptr());
+        return pos_type(gptr() - eback());
+    }
+    
+    pos_type seekpos(pos_type pos, ios_base::openmode which) override {
+        return seekoff(off_type(pos), ios_base::beg, which);
+    }
+};
+
+// Output stream buffer appending to a caller's vector
+class VectorBuf : public streambuf {
+public:
+    explicit VectorBuf(vector<uint8_t>& data) : data(data) {}
+    
+protected:
+    streamsize xsputn(const char* s, streamsize n) override {
+        data.insert(data.end(), s, s + n);
+        return n;
+    }
+    
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) data.push_back((uint8_t)c);
+        return c;
+    }
+    
+private:
+    vector<uint8_t>& data;
+};
+
+// Output stream buffer over a fixed caller buffer; writes past its end fail
+class FixedBuf : public streambuf {
+public:
+    FixedBuf(uint8_t* data, size_t size) {
+        char* p = reinterpret_cast<char*>(data);
+        setp(p, p + size);
+    }
+    
+    size_t written() const {
+        return (size_t)(pptr() - pbase());
+    }
+};
+
 string getFileNameWithoutExtension(const string& filepath) {
     size_t lastSlash = filepath.find_last_of("/\\");
     size_t lastDot = filepath.find_last_of('.');
@@ -56,6 +194,41 @@ string getFileNameWithoutExtension(const string& filepath) {
     return filename;
 }
 
+// Where an archive member is extracted, relative to the output directory:
+// its name with root, "." and ".." components dropped, so no member can be
+// written outside it. Empty when nothing is left.
+string archiveMemberPath(const string& name) {
+    string path;
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = min(name.find_first_of("/\\", start), name.size());
+        string part = name.substr(start, end - start);
+        if (!part.empty() && part != "." && part != ".." && part.find(':') == string::npos) {
+            path += (path.empty() ? "" : "/") + part;
+        }
+        start = end + 1;
+    }
+    return path;
+}
+
+// One .huf per input in outputDir, named after the input without its
+// extension. Names that would collide (log.1 and log.2, or equal file names
+// from different directories) keep their extension, then get a number.
+vector<string> batchOutputPaths(const vector<string>& files, const string& outputDir) {
+    vector<string> paths;
+    unordered_set<string> taken;
+    for (const string& file : files) {
+        string stem = getFileNameWithoutExtension(file);
+        string name = archiveMemberPath(file);
+        name = name.substr(name.find_last_of('/') + 1);
+        string candidate = taken.count(stem) ? name : stem;
+        for (int n = 2; taken.count(candidate); n++) candidate = name + "-" + to_string(n);
+        taken.insert(candidate);
+        paths.push_back(outputDir + "/" + candidate + ".huf");
+    }
+    return paths;
+}
+
 // Color codes for enhanced UI
 #define RESET   "\033[0m"
 #define RED     "\033[31m"
@@ -67,19 +240,224 @@ string getFileNameWithoutExtension(const string& filepath) {
 #define WHITE   "\033[37m"
 #define BOLD    "\033[1m"
 
-struct Node {
-    char ch;
-    int freq;
-    Node *left, *right;
-    Node(char c, int f) : ch(c), freq(f), left(nullptr), right(nullptr) {}
+// Huffman tree in a flat arena: the sorted leaves first, then internal nodes
+// in the order they are merged. Children are indices, so building and
+// dropping a tree never touches the heap.
+struct HuffmanTree {
+    struct Node {
+        uint64_t freq;
+        int16_t left, right;
+        uint8_t symbol;
+    };
+    
+    Node nodes[511];
+    int count = 0;
+    int leafCount = 0;
+    
+    // Merged weights come out in non-decreasing order, so two queues (leaves
+    // and internal nodes) replace the priority queue.
+    void build(const uint64_t freq[256]) {
+        count = 0;
+        for (int s = 0; s < 256; s++) {
+            if (freq[s]) nodes[count++] = Node{freq[s], -1, -1, (uint8_t)s};
+        }
+        leafCount = count;
+        sort(nodes, nodes + leafCount, [](const Node& a, const Node& b) {
+            return a.freq < b.freq || (a.freq == b.freq && a.symbol < b.symbol);
+        });
+        
+        int nextLeaf = 0, nextInner = leafCount;
+        auto takeSmallest = [&]() -> int16_t {
+            if (nextLeaf < leafCount && (nextInner == count || nodes[nextLeaf].freq <= nodes[nextInner].freq)) {
+                return (int16_t)nextLeaf++;
+            }
+            return (int16_t)nextInner++;
+        };
+        for (int merges = leafCount - 1; merges > 0; merges--) {
+            int16_t l = takeSmallest();
+            int16_t r = takeSmallest();
+            nodes[count] = Node{nodes[l].freq + nodes[r].freq, l, r, 0};
+            count++;
+        }
+    }
+    
+    // Writes the depth of every leaf into lengths and returns the deepest.
+    // Parents always follow their children, so one backwards pass suffices.
+    int codeLengths(uint8_t lengths[256]) const {
+        memset(lengths, 0, 256);
+        if (leafCount == 0) return 0;
+        if (leafCount == 1) {
+            lengths[nodes[0].symbol] = 1;
+            return 1;
+        }
+        
+        uint8_t depth[511];
+        depth[count - 1] = 0;
+        for (int i = count - 1; i >= leafCount; i--) {
+            depth[nodes[i].left] = depth[nodes[i].right] = depth[i] + 1;
+        }
+        
+        int deepest = 0;
+        for (int i = 0; i < leafCount; i++) {
+            lengths[nodes[i].symbol] = depth[i];
+            deepest = max(deepest, (int)depth[i]);
+        }
+        return deepest;
+    }
+};
+
+// Pipeline instrumentation. Defining FC_NO_STATS compiles the timers and
+// counters out; the fields then simply stay zero. The expression is kept
+// unevaluated under sizeof so values used only for stats stay referenced.
+#ifdef FC_NO_STATS
+#define FC_STAT(expr) ((void)sizeof(expr))
+#else
+#define FC_STAT(expr) (void)(expr)
+#endif
+
+// Adds the time until stop() or the end of the scope to sink, in nanoseconds
+class ScopedTimer {
+public:
+#ifdef FC_NO_STATS
+    explicit ScopedTimer(uint64_t&) {}
+    void stop() {}
+#else
+    explicit ScopedTimer(uint64_t& sink) : sink(sink), start(high_resolution_clock::now()) {}
+    ~ScopedTimer() { stop(); }
+    
+    void stop() {
+        if (running) sink += (uint64_t)duration_cast<nanoseconds>(high_resolution_clock::now() - start).count();
+        running = false;
+    }
+    
+private:
+    uint64_t& sink;
+    high_resolution_clock::time_point start;
+    bool running = true;
+#endif
+};
+
+// Nanoseconds spent in each pipeline step, summed over all blocks (so with
+// several workers the total exceeds the wall-clock time)
+struct StageTimes {
+    uint64_t read = 0;
+    uint64_t histogram = 0;
+    uint64_t match = 0;
+    uint64_t codeLengths = 0;
+    uint64_t header = 0;
+    uint64_t encode = 0;
+    uint64_t write = 0;
+    uint64_t tableBuild = 0;
+    uint64_t decode = 0;
+    uint64_t checksum = 0;
+    
+    template<class F> void forEach(F visit) const {
+        visit("read", read);
+        visit("histogram", histogram);
+        visit("match", match);
+        visit("code_lengths", codeLengths);
+        visit("header", header);
+        visit("encode", encode);
+        visit("write", write);
+        visit("table_build", tableBuild);
+        visit("decode", decode);
+        visit("checksum", checksum);
+    }
+    
+    StageTimes& operator/=(uint64_t n) {
+        for (uint64_t* stage : {&read, &histogram, &match, &codeLengths, &header, &encode, &write, &tableBuild, &decode,
+                               &checksum}) {
+            *stage /= n;
+        }
+        return *this;
+    }
+    
+    StageTimes& operator+=(const StageTimes& other) {
+        read += other.read;
+        histogram += other.histogram;
+        match += other.match;
+        codeLengths += other.codeLengths;
+        header += other.header;
+        encode += other.encode;
+        write += other.write;
+        tableBuild += other.tableBuild;
+        decode += other.decode;
+        checksum += other.checksum;
+        return *this;
+    }
 };
 
-struct Compare {
-    bool operator()(Node* a, Node* b) {
-        return a->freq > b->freq;
+// I/O and work counters. Reads and writes count stream operations (with the
+// default buffering, at most one syscall each; a mapped input costs none),
+// allocations counts the block buffers (input copies, records, decoded
+// output) that had to be allocated or grown. All three are counted where the
+// operation happens, through the counted helpers below.
+struct PipelineCounters {
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t readCalls = 0;
+    uint64_t writeCalls = 0;
+    uint64_t allocations = 0;
+    uint64_t blocks = 0;
+    uint64_t sampledBlocks = 0;    // coded from a sampled histogram
+    uint64_t resampledBlocks = 0;  // sample rejected, recounted in full
+    uint64_t chunks = 0;           // content-defined chunks of archive inputs
+    uint64_t duplicateChunks = 0;  // chunks stored once before, not encoded
+    uint64_t duplicateBytes = 0;
+    
+    template<class F> void forEach(F visit) const {
+        visit("bytes_read", bytesRead);
+        visit("bytes_written", bytesWritten);
+        visit("read_calls", readCalls);
+        visit("write_calls", writeCalls);
+        visit("allocations", allocations);
+        visit("blocks", blocks);
+        visit("sampled_blocks", sampledBlocks);
+        visit("resampled_blocks", resampledBlocks);
+        visit("chunks", chunks);
+        visit("duplicate_chunks", duplicateChunks);
+        visit("duplicate_bytes", duplicateBytes);
+    }
+    
+    PipelineCounters& operator+=(const PipelineCounters& other) {
+        bytesRead += other.bytesRead;
+        bytesWritten += other.bytesWritten;
+        readCalls += other.readCalls;
+        writeCalls += other.writeCalls;
+        allocations += other.allocations;
+        blocks += other.blocks;
+        sampledBlocks += other.sampledBlocks;
+        resampledBlocks += other.resampledBlocks;
+        chunks += other.chunks;
+        duplicateChunks += other.duplicateChunks;
+        duplicateBytes += other.duplicateBytes;
+        return *this;
     }
 };
 
+bool countedRead(istream& in, void* dst, size_t size, PipelineCounters& counters) {
+    in.read(reinterpret_cast<char*>(dst), size);
+    FC_STAT(counters.readCalls++);
+    FC_STAT(counters.bytesRead += (uint64_t)in.gcount());
+    return (bool)in;
+}
+
+void countedWrite(ostream& out, const void* src, size_t size, PipelineCounters& counters) {
+    out.write(reinterpret_cast<const char*>(src), size);
+    FC_STAT(counters.writeCalls++);
+    FC_STAT(counters.bytesWritten += size);
+}
+
+void countedReserve(vector<uint8_t>& buffer, size_t size, PipelineCounters& counters) {
+    FC_STAT(counters.allocations += size > buffer.capacity());
+    buffer.reserve(size);
+}
+
+void countedResize(vector<uint8_t>& buffer, size_t size, PipelineCounters& counters) {
+    FC_STAT(counters.allocations += size > buffer.capacity());
+    buffer.resize(size);
+}
+
 struct CompressionStats {
     size_t originalSize;
     size_t compressedSize;
@@ -88,333 +466,3958 @@ struct CompressionStats {
     int uniqueChars;
     duration<double> processingTime;
     string algorithm;
+    StageTimes stages;
+    PipelineCounters counters;
+    string error;  // why the operation failed, empty on success
 };
 
-class FileCompressor {
-private:
-    mutex progressMutex;
-    bool showProgress = true;
-    
-    void displayProgress(const string& operation, int percentage) {
-        if (!showProgress) return;
-        lock_guard<mutex> lock(progressMutex);
-        
-        cout << "\r" << CYAN << operation << ": " << RESET;
-        cout << "[";
-        int barWidth = 30;
-        int pos = barWidth * percentage / 100;
-        for (int i = 0; i < barWidth; ++i) {
-            if (i < pos) cout << GREEN << "█" << RESET;
-            else if (i == pos) cout << YELLOW << "█" << RESET;
-            else cout << " ";
-        }
-        cout << "] " << percentage << "%" << flush;
-        if (percentage >= 100) cout << endl;
+// What analyze() learns in one pass without compressing anything. Entropies
+// are in bits per byte; predictedSize is the level-0 output with per-block
+// Huffman codes, the same record choice compress() makes.
+struct FileAnalysis {
+    size_t size = 0;
+    int uniqueBytes = 0;
+    array<uint64_t, 256> frequencies = {};
+    double entropy = 0;
+    double conditionalEntropy = 0;  // order-1: given the previous byte
+    size_t blockSize = 0;
+    vector<double> blockEntropy;    // order-0, one entry per block
+    size_t predictedSize = 0;
+    duration<double> processingTime = duration<double>(0);
+};
+
+// Trailing zero bits of a nonzero value
+FC_ALWAYS_INLINE int countTrailingZeros(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
     }
+    return n;
+#endif
+}
+
+// Reads an MSB-first bitstream through a 64-bit buffer. The top bitCount bits
+// of buffer are valid; past the end of the input zero bits are shifted in,
+// which matches the zero padding written by compress(). Until then the
+// buffered bits are the ones just before pos, which the fast Huffman kernels
+// rely on, so a reader moved to other memory must move those bytes along.
+struct BitReader {
+    const uint8_t* pos;
+    const uint8_t* end;
+    uint64_t buffer = 0;
+    int bitCount = 0;
     
-    void buildCodeMap(Node* root, string str, unordered_map<char, string>& codeMap) {
-        if (!root) return;
-        if (!root->left && !root->right) {
-            codeMap[root->ch] = str.empty() ? "0" : str;
-        }
-        buildCodeMap(root->left, str + "0", codeMap);
-        buildCodeMap(root->right, str + "1", codeMap);
+    BitReader(const uint8_t* data, size_t size) : pos(data), end(data + size) {}
+    
+    static uint64_t loadBigEndian64(const uint8_t* p) {
+        return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) |
+               ((uint64_t)p[3] << 32) | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+               ((uint64_t)p[6] << 8) | (uint64_t)p[7];
     }
     
-    Node* readTree(ifstream& in) {
-        char type;
-        in.get(type);
-        if (type == '1') {
-            char ch;
-            in.get(ch);
-            return new Node(ch, 0);
-        } else if (type == '0') {
-            Node* l = readTree(in);
-            Node* r = readTree(in);
-            Node* node = new Node('\0', 0);
-            node->left = l;
-            node->right = r;
-            return node;
-        }
-        return nullptr;
-    }
-    
-    void writeTree(Node* node, ofstream& out) {
-        if (!node) return;
-        if (!node->left && !node->right) {
-            out.put('1');
-            out.put(node->ch);
+    // Guarantees at least 57 valid bits
+    void refill() {
+        if (end - pos >= 8) {
+            // Bits below bitCount are either zero or the same stream bits, so OR-ing is safe
+            buffer |= loadBigEndian64(pos) >> bitCount;
+            pos += (63 - bitCount) >> 3;
+            bitCount |= 56;
         } else {
-            out.put('0');
-            writeTree(node->left, out);
-            writeTree(node->right, out);
+            while (bitCount <= 56) {
+                uint64_t byte = (pos < end) ? *pos++ : 0;
+                buffer |= byte << (56 - bitCount);
+                bitCount += 8;
+            }
         }
     }
     
-    string formatFileSize(size_t bytes) {
-        const char* units[] = {"B", "KB", "MB", "GB", "TB"};
-        int unit = 0;
-        double size = bytes;
-        
-        while (size >= 1024 && unit < 4) {
-            size /= 1024;
-            unit++;
-        }
-        
-        return to_string(size).substr(0, 5) + " " + units[unit];
+    uint32_t peek(int n) const { return (uint32_t)(buffer >> (64 - n)); }
+    
+    // peek and consume in one, for any n from 0 to 32
+    uint32_t take(int n) {
+        uint32_t v = (uint32_t)((buffer >> 1) >> (63 - n));
+        consume(n);
+        return v;
     }
     
-    void displayHeader(const string& title) {
-        cout << "\n" << BOLD << BLUE << "╔══════════════════════════════════════════════════════════════════════════════════════════════╗" << RESET << endl;
-        cout << BOLD << BLUE << "║" << setw(46 + title.length()/2) << title << setw(46 - title.length()/2) << "║" << RESET << endl;
-        cout << BOLD << BLUE << "╚══════════════════════════════════════════════════════════════════════════════════════════════╝" << RESET << endl;
+    void consume(int n) {
+        buffer <<= n;
+        bitCount -= n;
     }
+};
+
+// Packs MSB-first codes of up to 32 bits through a 64-bit accumulator into a
+// caller-sized buffer, which needs room for the payload plus 4 bytes of slack.
+class BitWriter {
+public:
+    explicit BitWriter(uint8_t* dst) : start(dst), pos(dst) {}
     
-    void analyzeFile(const string& filename) {
-        ifstream file(filename, ios::binary);
-        if (!file) {
-            cout << RED << "Error: Cannot open file " << filename << RESET << endl;
-            return;
-        }
-        
-        cout << CYAN << "\n📊 File Analysis Report for: " << BOLD << filename << RESET << endl;
-        cout << "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━" << endl;
-        
-        unordered_map<char, int> freq;
-        char ch;
-        size_t totalChars = 0;
-        
-        while (file.get(ch)) {
-            freq[ch]++;
-            totalChars++;
+    void put(uint32_t code, int len) {
+        acc = (acc << len) | code;
+        bitCount += len;
+        if (bitCount >= 32) {
+            bitCount -= 32;
+            uint32_t word = (uint32_t)(acc >> bitCount);
+            pos[0] = (uint8_t)(word >> 24);
+            pos[1] = (uint8_t)(word >> 16);
+            pos[2] = (uint8_t)(word >> 8);
+            pos[3] = (uint8_t)word;
+            pos += 4;
         }
-        
-        cout << "📁 File Size: " << formatFileSize(totalChars) << " (" << totalChars << " bytes)" << endl;
-        cout << "🔤 Unique Characters: " << freq.size() << endl;
-        cout << "📈 Entropy: " << calculateEntropy(freq, totalChars) << " bits" << endl;
-        
-        // Show top 10 most frequent characters
-        vector<pair<char, int>> sortedFreq(freq.begin(), freq.end());
-        sort(sortedFreq.begin(), sortedFreq.end(), [](const auto& a, const auto& b) {
-            return a.second > b.second;
-        });
-        
-        cout << "\n🏆 Top 10 Most Frequent Characters:" << endl;
-        for (int i = 0; i < min(10, (int)sortedFreq.size()); i++) {
-            char c = sortedFreq[i].first;
-            string charDisplay = (c == ' ') ? "SPACE" : 
-                                (c == '\n') ? "NEWLINE" : 
-                                (c == '\t') ? "TAB" : string(1, c);
-            cout << "   " << i+1 << ". '" << charDisplay << "' : " << sortedFreq[i].second 
-                 << " (" << fixed << setprecision(2) << (100.0 * sortedFreq[i].second / totalChars) << "%)" << endl;
+    }
+    
+    // Pads the last byte with zero bits; returns the number of bytes written
+    size_t finish() {
+        while (bitCount > 0) {
+            int take = min(bitCount, 8);
+            *pos++ = (uint8_t)(((acc >> (bitCount - take)) & ((1u << take) - 1)) << (8 - take));
+            bitCount -= take;
         }
-        
-        file.close();
+        return pos - start;
     }
     
-    double calculateEntropy(const unordered_map<char, int>& freq, size_t total) {
-        double entropy = 0.0;
-        for (const auto& pair : freq) {
-            double probability = (double)pair.second / total;
-            entropy -= probability * log2(probability);
+private:
+    uint8_t* start;
+    uint8_t* pos;
+    uint64_t acc = 0;
+    int bitCount = 0;
+};
+
+FC_ALWAYS_INLINE void storeBigEndian64(uint8_t* p, uint64_t v) {
+    p[0] = (uint8_t)(v >> 56);
+    p[1] = (uint8_t)(v >> 48);
+    p[2] = (uint8_t)(v >> 40);
+    p[3] = (uint8_t)(v >> 32);
+    p[4] = (uint8_t)(v >> 24);
+    p[5] = (uint8_t)(v >> 16);
+    p[6] = (uint8_t)(v >> 8);
+    p[7] = (uint8_t)v;
+}
+
+// Appends the codes of data[0] .. data[sizeof...(K) - 1] to acc; the pack
+// expansion is the unrolled loop
+template <size_t... K>
+FC_ALWAYS_INLINE void putCodes(const uint8_t* data, const uint32_t code[256], const uint8_t len[256], uint64_t& acc,
+                               int& bits, index_sequence<K...>) {
+    ((acc = (acc << len[data[K]]) | code[data[K]], bits += len[data[K]]), ...);
+}
+
+// Huffman-codes data MSB first, in the same stream BitWriter would write, for
+// codes of at most MaxLen bits. The codes of (64 - 7) / MaxLen bytes fit the
+// 64-bit buffer on top of the up to 7 bits a flush leaves behind, so they go
+// in unrolled with no check per code, and a flush is one 8-byte store of
+// which the whole bytes are kept. dst needs 8 bytes of slack. Every coded
+// stripe of at most stripe bytes is handed to done(begin, size), for passes
+// that want the bytes while they are still in cache.
+struct IgnoreStripes {
+    void operator()(const uint8_t*, size_t) const {}
+};
+
+template <int MaxLen, class Done = IgnoreStripes>
+size_t encodeSymbols(const uint8_t* data, size_t size, const uint32_t code[256], const uint8_t len[256],
+                     uint8_t* dst, size_t stripe = SIZE_MAX, Done done = Done()) {
+    constexpr int kPerFlush = (64 - 7) / MaxLen;
+    static_assert(kPerFlush >= 1, "a code must fit the bit buffer");
+    uint64_t acc = 0;
+    int bits = 0;
+    uint8_t* pos = dst;
+    
+    size_t i = 0, from = 0;
+    while (i + kPerFlush <= size) {
+        size_t stop = size - i > stripe ? i + stripe : size;
+        for (; i + kPerFlush <= stop; i += kPerFlush) {
+            putCodes(data + i, code, len, acc, bits, make_index_sequence<kPerFlush>());
+            storeBigEndian64(pos, acc << (64 - bits));
+            pos += bits >> 3;
+            bits &= 7;
         }
-        return entropy;
+        done(data + from, i - from);
+        from = i;
+    }
+    for (; i < size; i++) {
+        acc = (acc << len[data[i]]) | code[data[i]];
+        bits += len[data[i]];
+        storeBigEndian64(pos, acc << (64 - bits));
+        pos += bits >> 3;
+        bits &= 7;
     }
     
+    if (size > from) done(data + from, size - from);
+    
+    // The low bits shifted in above are the zero padding
+    if (bits) storeBigEndian64(pos++, acc << (64 - bits));
+    return pos - dst;
+}
+
+// Builds a bit stream back to front, ending at the end of a caller-sized
+// buffer: the last value put is the first one a BitReader returns. Values are
+// up to 32 bits and must fit in len bits.
+class ReverseBitWriter {
 public:
-    CompressionStats compress(const string& inputFile, const string& outputFile) {
-        auto startTime = high_resolution_clock::now();
-        CompressionStats stats;
-        stats.algorithm = "Huffman Coding";
-        
-        ifstream in(inputFile, ios::binary);
-        ofstream out(outputFile, ios::binary);
-        
-        if (!in || !out) {
-            cout << RED << "Error: Cannot open files!" << RESET << endl;
-            return stats;
+    explicit ReverseBitWriter(uint8_t* dstEnd) : end(dstEnd), pos(dstEnd) {}
+    
+    void put(uint32_t value, int len) {
+        acc |= (uint64_t)value << bitCount;
+        bitCount += len;
+        if (bitCount >= 32) {
+            pos -= 4;
+            pos[0] = (uint8_t)(acc >> 24);
+            pos[1] = (uint8_t)(acc >> 16);
+            pos[2] = (uint8_t)(acc >> 8);
+            pos[3] = (uint8_t)acc;
+            acc >>= 32;
+            bitCount -= 32;
         }
-        
-        displayProgress("Reading file", 10);
-        
-        // Count frequencies
-        unordered_map<char, int> freq;
-        char ch;
-        size_t totalChars = 0;
-        
-        while (in.get(ch)) {
-            freq[ch]++;
-            totalChars++;
+    }
+    
+    // Flushes the remaining bits, zero-padded at the front of the first byte;
+    // returns the number of bytes written, which start at end - count
+    size_t finish(int& padBits) {
+        padBits = (8 - bitCount % 8) % 8;
+        while (bitCount > 0) {
+            *--pos = (uint8_t)acc;
+            acc >>= 8;
+            bitCount -= 8;
         }
+        return end - pos;
+    }
+    
+private:
+    uint8_t* end;
+    uint8_t* pos;
+    uint64_t acc = 0;
+    int bitCount = 0;
+};
+
+// One probe of the decode table. Leaves resolve one or two whole symbols;
+// firstLength is the code length of symbol[0] and equals length when the
+// entry holds a single symbol. A link (firstLength == 0) consumes length bits
+// and continues in the subtable symbol[0]; length == 0 marks an unused code.
+struct DecodeEntry {
+    uint8_t symbol[2];
+    uint8_t length;
+    uint8_t firstLength;
+};
+
+class HuffmanDecoder {
+public:
+    static constexpr int kPrimaryBits = 11;
+    static constexpr int kSubtableBits = 8;
+    
+    // codes[s] holds the lengths[s] low bits of the code for byte s (MSB first),
+    // lengths[s] == 0 for bytes that never occur
+    bool build(const uint64_t codes[256], const uint8_t lengths[256]) {
+        entries.assign(1 << kPrimaryBits, DecodeEntry{{0, 0}, 0, 0});
+        subtableOffset.clear();
+        subtableBits.clear();
         
-        stats.originalSize = totalChars;
-        stats.uniqueChars = freq.size();
-        
-        displayProgress("Building frequency table", 30);
-        
-        in.clear();
-        in.seekg(0);
+        vector<int> symbols;
+        for (int s = 0; s < 256; s++) {
+            if (lengths[s] > 64) return false;
+            if (lengths[s]) symbols.push_back(s);
+        }
+        if (!buildLevel(0, kPrimaryBits, 0, symbols, codes, lengths)) return false;
         
-        // Build Huffman tree
-        priority_queue<Node*, vector<Node*>, Compare> pq;
-        for (auto& pair : freq) {
-            pq.push(new Node(pair.first, pair.second));
+        // Pair up short codes: if the bits left over after the first symbol
+        // fully determine a second one, resolve both in a single probe
+        vector<DecodeEntry> single(entries.begin(), entries.begin() + (1 << kPrimaryBits));
+        const uint32_t mask = (1u << kPrimaryBits) - 1;
+        for (uint32_t i = 0; i <= mask; i++) {
+            const DecodeEntry& first = single[i];
+            if (first.firstLength == 0 || first.length >= kPrimaryBits) continue;
+            const DecodeEntry& second = single[(i << first.length) & mask];
+            if (second.firstLength == 0 || first.length + second.length > kPrimaryBits) continue;
+            entries[i].symbol[1] = second.symbol[0];
+            entries[i].length = first.length + second.length;
         }
         
-        displayProgress("Building Huffman tree", 50);
+        // Complete codes no longer than kPrimaryBits (the default limit) need
+        // neither the link nor the invalid-code check. Longer codes, from a
+        // raised limit or sampled escapes, take one subtable probe in the
+        // fast kernels as long as they fit its bit budget.
+        leavesOnly = subtableOffset.empty() &&
+                     all_of(entries.begin(), entries.end(), [](const DecodeEntry& e) { return e.length != 0; });
+        int longest = 0;
+        for (int s : symbols) longest = max(longest, (int)lengths[s]);
+        fastLong = !leavesOnly && longest <= kMaxFastLength;
+        return true;
+    }
+    
+    // Decodes exactly count symbols into out; false on an invalid code
+    bool decode(BitReader& br, uint8_t* out, size_t count) const {
+        const DecodeEntry* table = entries.data();
+        uint8_t* end = out + count;
+        if (!decodeFast<1>(&br, &out, &end)) return false;
         
-        // Handle single character file
-        if (pq.size() == 1) {
-            Node* single = pq.top();
-            Node* root = new Node('\0', single->freq);
-            root->left = single;
-            pq.pop();
-            pq.push(root);
+        while (end - out >= 2) {
+            br.refill();
+            DecodeEntry e = table[br.peek(kPrimaryBits)];
+            if (e.firstLength == 0) {
+                if (!decodeLong(br, e, out)) return false;
+                continue;
+            }
+            out[0] = e.symbol[0];
+            out[1] = e.symbol[1];
+            out += 1 + (e.length != e.firstLength);
+            br.consume(e.length);
         }
-        
-        while (pq.size() > 1) {
-            Node *l = pq.top(); pq.pop();
-            Node *r = pq.top(); pq.pop();
-            Node* merged = new Node('\0', l->freq + r->freq);
-            merged->left = l;
-            merged->right = r;
-            pq.push(merged);
+        if (out < end) {
+            br.refill();
+            DecodeEntry e = table[br.peek(kPrimaryBits)];
+            if (e.firstLength == 0) return decodeLong(br, e, out);
+            *out = e.symbol[0];
+            br.consume(e.firstLength);
         }
-        
-        Node* root = pq.top();
-        unordered_map<char, string> codeMap;
-        buildCodeMap(root, "", codeMap);
-        
-        displayProgress("Generating codes", 70);
-        
-        // Write magic number and version
-        out.write("HUF1", 4);
-        
-        // Write tree
-        writeTree(root, out);
-        out.put('#'); // Tree delimiter
-        
-        // Write original file size
-        out.write(reinterpret_cast<const char*>(&totalChars), sizeof(totalChars));
-        
-        displayProgress("Encoding data", 85);
-        
-        // Encode data
-        string buffer;
-        while (in.get(ch)) {
-            buffer += codeMap[ch];
+        return true;
+    }
+    
+    // Decodes four independent streams into out[k] .. out[k] + count[k]. The
+    // streams share no state, so their table lookups overlap in the pipeline
+    // instead of forming one dependent chain.
+    bool decode4(BitReader br[4], uint8_t* const out[4], const size_t count[4]) const {
+        uint8_t* pos[4];
+        uint8_t* end[4];
+        for (int k = 0; k < 4; k++) {
+            pos[k] = out[k];
+            end[k] = out[k] + count[k];
         }
+        if (!decodeFast<4>(br, pos, end)) return false;
         
-        // Add padding
-        int padding = 8 - (buffer.size() % 8);
-        if (padding != 8) {
-            buffer += string(padding, '0');
+        while (true) {
+            // Named locals whose address never escapes stay in registers;
+            // stores through the byte pointers would otherwise reload them
+            BitReader b0 = br[0], b1 = br[1], b2 = br[2], b3 = br[3];
+            uint8_t* o0 = pos[0];
+            uint8_t* o1 = pos[1];
+            uint8_t* o2 = pos[2];
+            uint8_t* o3 = pos[3];
+            
+            // Each probe emits at most two symbols, and two probes of at most
+            // kPrimaryBits fit one refill
+            bool ok = true;
+            while (ok && o0 + 4 <= end[0] && o1 + 4 <= end[1] && o2 + 4 <= end[2] && o3 + 4 <= end[3]) {
+                b0.refill();
+                b1.refill();
+                b2.refill();
+                b3.refill();
+                ok = probe(b0, o0) & probe(b1, o1) & probe(b2, o2) & probe(b3, o3);
+                ok = probe(b0, o0) & probe(b1, o1) & probe(b2, o2) & probe(b3, o3) & ok;
+            }
+            br[0] = b0;
+            br[1] = b1;
+            br[2] = b2;
+            br[3] = b3;
+            pos[0] = o0;
+            pos[1] = o1;
+            pos[2] = o2;
+            pos[3] = o3;
+            if (ok) break;
+            
+            // A code longer than kPrimaryBits stopped the loop
+            for (int k = 0; k < 4; k++) {
+                if (pos[k] == end[k]) continue;
+                br[k].refill();
+                DecodeEntry e = entries[br[k].peek(kPrimaryBits)];
+                if (e.firstLength == 0 && !decodeLong(br[k], e, pos[k])) return false;
+            }
         }
         
-        out.put((char)padding);
-        
-        for (size_t i = 0; i < buffer.size(); i += 8) {
-            bitset<8> b(buffer.substr(i, 8));
-            out.put((unsigned char)b.to_ulong());
+        for (int k = 0; k < 4; k++) {
+            if (!decode(br[k], pos[k], end[k] - pos[k])) return false;
         }
-        
-        displayProgress("Compression complete", 100);
-        
-        in.close();
-        out.close();
-        
-        auto endTime = high_resolution_clock::now();
-        stats.processingTime = duration_cast<duration<double>>(endTime - startTime);
-        
-        // Calculate compressed size
-        stats.compressedSize = getFileSize(outputFile);
-        stats.compressionRatio = (double)stats.compressedSize / stats.originalSize;
-        stats.spaceSavings = (1.0 - stats.compressionRatio) * 100;
-        
-        return stats;
+        return true;
     }
     
-    bool decompress(const string& inputFile, const string& outputFile) {
-        auto startTime = high_resolution_clock::now();
-        
-        ifstream in(inputFile, ios::binary);
-        ofstream out(outputFile, ios::binary);
-        
-        if (!in || !out) {
-            cout << RED << "Error: Cannot open files!" << RESET << endl;
-            return false;
+private:
+    vector<DecodeEntry> entries;
+    vector<uint32_t> subtableOffset;
+    vector<uint8_t> subtableBits;
+    bool leavesOnly = false;
+    bool fastLong = false;  // not leaves only, but no code over kMaxFastLength
+    
+    // The fast kernels keep a stream's unread bits on top of a single marker
+    // 1 bit, so the count of consumed bits is the trailing zero count and
+    // needs no register of its own; x86 has too few for four streams
+    // otherwise. A refill is then one load and one shift, with no branch:
+    // the kernels only run while every stream has 8 bytes left to load.
+    // A refill leaves at least 56 bits: four probes of at most kPrimaryBits,
+    // or three of at most kMaxFastLength when codes can be longer. Either
+    // way a round moves in by at most 6 bytes.
+    static constexpr int kMaxFastLength = 15;
+    
+    // Rounds of Probes probes that cannot load past inEnd or write past
+    // outEnd; a round moves in by at most 6 bytes and out by 2 per probe
+    template <int Probes>
+    static size_t fastRounds(const uint8_t* in, const uint8_t* inEnd, const uint8_t* out, const uint8_t* outEnd) {
+        if (inEnd - in < 8) return 0;
+        return min((size_t)(inEnd - in - 8) / 6, (size_t)(outEnd - out) / (2 * Probes));
+    }
+    
+    // BitReader state to marker form; false when fewer than 8 bytes are left
+    static bool enterFast(const BitReader& br, const uint8_t*& in, uint64_t& bits) {
+        if (br.pos >= br.end) return false;  // the buffer may hold padding zeros
+        in = br.pos - (br.bitCount + 7) / 8;
+        if (br.end - in < 8) return false;
+        bits = (BitReader::loadBigEndian64(in) | 1) << ((8 - br.bitCount % 8) % 8);
+        return true;
+    }
+    
+    static void leaveFast(BitReader& br, const uint8_t* in, uint64_t bits) {
+        int consumed = countTrailingZeros(bits);
+        br = BitReader(in + (consumed >> 3), br.end - in - (consumed >> 3));
+        br.refill();
+        br.consume(consumed & 7);
+    }
+    
+    static FC_ALWAYS_INLINE void refillFast(const uint8_t*& in, uint64_t& bits) {
+        int consumed = countTrailingZeros(bits);
+        in += consumed >> 3;
+        bits = (BitReader::loadBigEndian64(in) | 1) << (consumed & 7);
+    }
+    
+    // Writes both symbol bytes whether or not the entry holds two. With
+    // LongCodes, a link is followed into its subtable; false on an invalid
+    // code, after which the stream's state is garbage.
+    template <bool LongCodes>
+    FC_ALWAYS_INLINE bool probeFast(const DecodeEntry* table, uint64_t& bits, uint8_t*& out) const {
+        DecodeEntry e = table[bits >> (64 - kPrimaryBits)];
+        if (LongCodes && e.firstLength == 0) {
+            if (e.length == 0) return false;
+            bits <<= kPrimaryBits;
+            int id = e.symbol[0];
+            e = table[subtableOffset[id] + (bits >> (64 - subtableBits[id]))];
+            *out++ = e.symbol[0];
+            bits <<= e.firstLength;
+            return e.firstLength != 0;
+        }
+        memcpy(out, e.symbol, 2);
+        out += 1 + (e.length != e.firstLength);
+        bits <<= e.length;
+        return true;
+    }
+    
+    // Runs the fast kernel that fits the table, if any, on Streams streams;
+    // false on an invalid code. The choice is made once per call, so the
+    // kernels' loops carry no checks on the code lengths.
+    template <int Streams>
+    bool decodeFast(BitReader* br, uint8_t** pos, uint8_t* const* end) const {
+        if (!leavesOnly && !fastLong) return true;
+#if FC_X86_TARGETS
+        if (bmi2()) return leavesOnly ? fastKernelBmi2<Streams, false>(br, pos, end)
+                                      : fastKernelBmi2<Streams, true>(br, pos, end);
+#endif
+        return leavesOnly ? fastKernel<Streams, false>(br, pos, end) : fastKernel<Streams, true>(br, pos, end);
+    }
+    
+    // Loops over the streams are expanded in full so that each stream's
+    // state stays in registers; the probe loop is left to the compiler.
+    template <int Streams, bool LongCodes>
+    FC_ALWAYS_INLINE bool fastKernel(BitReader* br, uint8_t** pos, uint8_t* const* end) const {
+        constexpr int kProbes = LongCodes ? 3 : 4;
+        const DecodeEntry* table = entries.data();
+        const uint8_t* in[Streams];
+        uint64_t bits[Streams];
+        uint8_t* out[Streams];
+        FC_UNROLL_STREAMS
+        for (int k = 0; k < Streams; k++) {
+            if (!enterFast(br[k], in[k], bits[k])) return true;
+            out[k] = pos[k];
+        }
+        
+        bool ok = true;
+        while (true) {
+            size_t rounds = SIZE_MAX;
+            FC_UNROLL_STREAMS
+            for (int k = 0; k < Streams; k++) rounds = min(rounds, fastRounds<kProbes>(in[k], br[k].end, out[k], end[k]));
+            if (rounds == 0) break;
+            for (; rounds && ok; rounds--) {
+                for (int p = 0; p < kProbes; p++) {
+                    FC_UNROLL_STREAMS
+                    for (int k = 0; k < Streams; k++) ok &= probeFast<LongCodes>(table, bits[k], out[k]);
+                }
+                FC_UNROLL_STREAMS
+                for (int k = 0; k < Streams; k++) refillFast(in[k], bits[k]);
+            }
+            if (!ok) return false;
+        }
+        FC_UNROLL_STREAMS
+        for (int k = 0; k < Streams; k++) {
+            pos[k] = out[k];
+            leaveFast(br[k], in[k], bits[k]);
+        }
+        return true;
+    }
+    
+#if FC_X86_TARGETS
+    // BMI2 turns the variable shifts into single shlx/shrx and BMI1 the
+    // trailing zero count into tzcnt
+    static bool bmi2() {
+        static const bool supported = __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+        return supported;
+    }
+    
+    template <int Streams, bool LongCodes>
+    __attribute__((target("bmi,bmi2"))) bool fastKernelBmi2(BitReader* br, uint8_t** pos, uint8_t* const* end) const {
+        return fastKernel<Streams, LongCodes>(br, pos, end);
+    }
+#endif
+    
+    // Fills the tableBits-wide table at offset with every symbol whose code
+    // shares the consumed-bit prefix leading to it
+    bool buildLevel(size_t offset, int tableBits, int consumed, const vector<int>& symbols,
+                    const uint64_t codes[256], const uint8_t lengths[256]) {
+        vector<vector<int>> overflow(size_t(1) << tableBits);
+        for (int s : symbols) {
+            int remaining = lengths[s] - consumed;
+            uint64_t code = codes[s] & (remaining >= 64 ? ~0ull : ((1ull << remaining) - 1));
+            if (remaining <= tableBits) {
+                size_t first = code << (tableBits - remaining);
+                size_t span = size_t(1) << (tableBits - remaining);
+                for (size_t i = first; i < first + span; i++) {
+                    if (entries[offset + i].length) return false; // not a prefix code
+                    entries[offset + i] = DecodeEntry{{(uint8_t)s, 0}, (uint8_t)remaining, (uint8_t)remaining};
+                }
+            } else {
+                overflow[code >> (remaining - tableBits)].push_back(s);
+            }
+        }
+        
+        for (size_t prefix = 0; prefix < overflow.size(); prefix++) {
+            if (overflow[prefix].empty()) continue;
+            if (entries[offset + prefix].length) return false;
+            
+            int longest = 0;
+            for (int s : overflow[prefix]) longest = max(longest, (int)lengths[s]);
+            int bits = min(kSubtableBits, longest - consumed - tableBits);
+            
+            size_t id = subtableOffset.size();
+            if (id > 255) return false;
+            size_t subOffset = entries.size();
+            subtableOffset.push_back((uint32_t)subOffset);
+            subtableBits.push_back((uint8_t)bits);
+            entries.resize(subOffset + (size_t(1) << bits), DecodeEntry{{0, 0}, 0, 0});
+            entries[offset + prefix] = DecodeEntry{{(uint8_t)id, 0}, (uint8_t)tableBits, 0};
+            
+            if (!buildLevel(subOffset, bits, consumed + tableBits, overflow[prefix], codes, lengths)) return false;
+        }
+        return true;
+    }
+    
+    // One primary-table probe for decode4; false, consuming nothing, when
+    // the code continues in a subtable
+    bool probe(BitReader& br, uint8_t*& out) const {
+        DecodeEntry e = entries[br.peek(kPrimaryBits)];
+        if (e.firstLength == 0) return false;
+        out[0] = e.symbol[0];
+        out[1] = e.symbol[1];
+        out += 1 + (e.length != e.firstLength);
+        br.consume(e.length);
+        return true;
+    }
+    
+    // Follows links into the overflow subtables for codes longer than kPrimaryBits
+    bool decodeLong(BitReader& br, DecodeEntry e, uint8_t*& out) const {
+        while (e.firstLength == 0) {
+            if (e.length == 0) return false;
+            br.consume(e.length);
+            br.refill();
+            int id = e.symbol[0];
+            e = entries[subtableOffset[id] + br.peek(subtableBits[id])];
+        }
+        *out++ = e.symbol[0];
+        br.consume(e.firstLength);
+        return true;
+    }
+};
+
+// Table-based ANS over bytes (the FSE construction). Frequencies are
+// normalized to 1 << tableLog slots spread across the state table, so a byte
+// of probability p costs close to -log2(p) bits instead of a whole-bit code
+// length. The encoder walks a block back to front and the decoder reads the
+// stream forward; two interleaved states hide the table-lookup latency.
+struct AnsTable {
+    static constexpr int kMinTableLog = 5;
+    static constexpr int kMaxTableLog = 12;
+    static constexpr int kDefaultTableLog = 11;
+    
+    static int floorLog2(uint32_t v) {
+        int n = 0;
+        while (v >>= 1) n++;
+        return n;
+    }
+    
+    // Smaller tables for short blocks, but always more slots than used symbols
+    static int tableLogFor(size_t size, int used) {
+        int log = kDefaultTableLog;
+        if (size > 1) log = min(log, floorLog2((uint32_t)min(size - 1, (size_t)UINT32_MAX)) - 2);
+        log = max(log, floorLog2((uint32_t)used) + 1);
+        return min(max(log, kMinTableLog), kMaxTableLog);
+    }
+    
+    // Scales freq to sum to 1 << tableLog, keeping every present symbol at one
+    // slot or more; the rounding error goes to (or comes from) the largest counts
+    static void normalize(const uint64_t freq[256], size_t total, int tableLog, uint16_t norm[256]) {
+        int64_t slots = int64_t(1) << tableLog;
+        int64_t sum = 0;
+        int largest = 0;
+        for (int s = 0; s < 256; s++) {
+            norm[s] = 0;
+            if (!freq[s]) continue;
+            norm[s] = (uint16_t)max<int64_t>(1, llround((double)freq[s] * slots / total));
+            sum += norm[s];
+            if (freq[s] > freq[largest]) largest = s;
+        }
+        if (sum < slots) {
+            norm[largest] += (uint16_t)(slots - sum);
+            return;
+        }
+        while (sum > slots) {
+            int biggest = (int)(max_element(norm, norm + 256) - norm);
+            norm[biggest]--;
+            sum--;
+        }
+    }
+    
+    // Payload bits the normalized table spends on these frequencies
+    static double cost(const uint64_t freq[256], const uint16_t norm[256], int tableLog) {
+        double bits = 0;
+        for (int s = 0; s < 256; s++) {
+            if (freq[s]) bits += freq[s] * (tableLog - log2((double)norm[s]));
+        }
+        return bits;
+    }
+    
+    // Slot owners in the state table. The odd stride visits every slot once and
+    // scatters each symbol's slots, which keeps the states close to optimal.
+    static void spreadSymbols(const uint16_t norm[256], int tableLog, uint8_t* owner) {
+        uint32_t size = 1u << tableLog;
+        uint32_t mask = size - 1;
+        uint32_t step = (size >> 1) + (size >> 3) + 3;
+        uint32_t pos = 0;
+        for (int s = 0; s < 256; s++) {
+            for (int i = 0; i < norm[s]; i++) {
+                owner[pos] = (uint8_t)s;
+                pos = (pos + step) & mask;
+            }
+        }
+    }
+};
+
+class AnsEncoder {
+public:
+    void build(const uint16_t norm[256], int log) {
+        tableLog = log;
+        uint32_t size = 1u << log;
+        vector<uint8_t> owner(size);
+        AnsTable::spreadSymbols(norm, log, owner.data());
+        
+        // A symbol with n slots leaves states in [n, 2n) after shifting out
+        // maxBits or one bit fewer; the threshold folds into deltaBits
+        uint32_t next[256];
+        uint32_t start = 0;
+        for (int s = 0; s < 256; s++) {
+            next[s] = start;
+            transform[s] = Transform{0, 0};
+            if (norm[s] == 1) {
+                transform[s] = Transform{((uint32_t)log << 16) - size, (int32_t)start - 1};
+            } else if (norm[s] > 1) {
+                uint32_t maxBits = log - AnsTable::floorLog2(norm[s] - 1u);
+                transform[s] = Transform{(maxBits << 16) - ((uint32_t)norm[s] << maxBits), (int32_t)start - norm[s]};
+            }
+            start += norm[s];
+        }
+        stateTable.resize(size);
+        for (uint32_t u = 0; u < size; u++) stateTable[next[owner[u]]++] = (uint16_t)(size + u);
+    }
+    
+    // Upper bound of encode's output
+    size_t bound(size_t count) const {
+        return (count * tableLog + 2 * tableLog) / 8 + 8;
+    }
+    
+    // Encodes count symbols into the bytes ending at end; returns the byte
+    // count and the zero bits padding the front of the first byte
+    size_t encode(const uint8_t* data, size_t count, uint8_t* end, int& padBits) const {
+        ReverseBitWriter writer(end);
+        uint32_t size = 1u << tableLog;
+        uint32_t even = size, odd = size;
+        
+        size_t i = count;
+        if (i & 1) step(even, data[--i], writer);
+        while (i >= 2) {
+            step(odd, data[i - 1], writer);
+            step(even, data[i - 2], writer);
+            i -= 2;
+        }
+        writer.put(odd - size, tableLog);
+        writer.put(even - size, tableLog);
+        return writer.finish(padBits);
+    }
+    
+private:
+    struct Transform {
+        uint32_t deltaBits;
+        int32_t deltaState;
+    };
+    
+    Transform transform[256];
+    vector<uint16_t> stateTable;
+    int tableLog = 0;
+    
+    void step(uint32_t& state, uint8_t symbol, ReverseBitWriter& writer) const {
+        Transform t = transform[symbol];
+        uint32_t bits = (state + t.deltaBits) >> 16;
+        writer.put(state & ((1u << bits) - 1), bits);
+        state = stateTable[(int32_t)(state >> bits) + t.deltaState];
+    }
+};
+
+// One decoder state: the byte it emits and the next state, which is
+// nextState plus the value of the next `bits` stream bits
+struct AnsDecodeEntry {
+    uint16_t nextState;
+    uint8_t symbol;
+    uint8_t bits;
+};
+
+class AnsDecoder {
+public:
+    void build(const uint16_t norm[256], int log) {
+        tableLog = log;
+        uint32_t size = 1u << log;
+        vector<uint8_t> owner(size);
+        AnsTable::spreadSymbols(norm, log, owner.data());
+        
+        uint32_t next[256];
+        for (int s = 0; s < 256; s++) next[s] = norm[s];
+        entries.resize(size);
+        for (uint32_t u = 0; u < size; u++) {
+            uint8_t s = owner[u];
+            uint32_t n = next[s]++;
+            int bits = log - AnsTable::floorLog2(n);
+            entries[u] = AnsDecodeEntry{(uint16_t)((n << bits) - size), s, (uint8_t)bits};
+        }
+    }
+    
+    // Decodes exactly count symbols. States stay inside the table whatever
+    // the input, so corrupt data decodes to garbage rather than failing.
+    // Hands every finished stripe of at most stripe bytes, a multiple of 4,
+    // to done(begin, size) while it is still in cache
+    template <class Done>
+    void decode(BitReader& br, uint8_t* out, size_t count, size_t stripe, Done done) const {
+        const AnsDecodeEntry* table = entries.data();
+        uint8_t* end = out + count;
+        
+        br.refill();
+        uint32_t even = br.take(tableLog);
+        uint32_t odd = br.take(tableLog);
+        
+        // Four steps of at most 12 bits fit one refill
+        while (end - out >= 4) {
+            uint8_t* begin = out;
+            uint8_t* stripeEnd = out + min((size_t)(end - out) & ~(size_t)3, stripe);
+            while (out < stripeEnd) {
+                br.refill();
+                out[0] = step(table, even, br);
+                out[1] = step(table, odd, br);
+                out[2] = step(table, even, br);
+                out[3] = step(table, odd, br);
+                out += 4;
+            }
+            done(begin, (size_t)(out - begin));
+        }
+        uint8_t* begin = out;
+        for (bool useOdd = false; out < end; useOdd = !useOdd) {
+            br.refill();
+            *out++ = step(table, useOdd ? odd : even, br);
+        }
+        if (out > begin) done(begin, (size_t)(out - begin));
+    }
+    
+private:
+    vector<AnsDecodeEntry> entries;
+    int tableLog = 0;
+    
+    static uint8_t step(const AnsDecodeEntry* table, uint32_t& state, BitReader& br) {
+        AnsDecodeEntry e = table[state];
+        state = e.nextState + br.take(e.bits);
+        return e.symbol;
+    }
+};
+
+// Work-stealing scheduler. Every worker owns a deque: it pushes and pops its
+// own tasks at the back and, when idle, steals from the front of the others.
+// Tasks marked mayWait (whole-file jobs) can block on other tasks; a worker
+// that waits keeps running queued non-waiting tasks (block codecs) meanwhile,
+// so nested parallelism never deadlocks and never nests deeper than one job.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned count) : queues(max(count, 1u)) {
+        for (unsigned i = 0; i < queues.size(); i++) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+    
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+    
+    template <class F>
+    auto submit(F task, bool mayWait = false) -> future<decltype(task())> {
+        auto packaged = make_shared<packaged_task<decltype(task())()>>(move(task));
+        auto result = packaged->get_future();
+        
+        size_t target = (currentPool == this) ? currentWorker : nextQueue++ % queues.size();
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            queued++;
+        }
+        {
+            lock_guard<mutex> lock(queues[target].lock);
+            queues[target].tasks.push_back(Task{[packaged] { (*packaged)(); }, mayWait});
+        }
+        workAvailable.notify_one();
+        return result;
+    }
+    
+    // Waits for a future's or shared_future's result; on a worker thread,
+    // runs other non-waiting tasks instead of blocking
+    template <class Future>
+    auto await(Future& result) -> decltype(result.get()) {
+        if (currentPool == this) {
+            while (result.wait_for(seconds(0)) != future_status::ready) {
+                if (!runOne(currentWorker, false)) result.wait_for(microseconds(50));
+            }
+        }
+        return result.get();
+    }
+    
+    unsigned size() const { return (unsigned)workers.size(); }
+    
+private:
+    struct Task {
+        function<void()> run;
+        bool mayWait;
+    };
+    
+    struct WorkerQueue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+    
+    vector<WorkerQueue> queues;
+    vector<thread> workers;
+    atomic<size_t> nextQueue{0};
+    mutex sleepMutex;
+    condition_variable workAvailable;
+    size_t queued = 0;
+    bool stopping = false;
+    
+    static inline thread_local WorkStealingPool* currentPool = nullptr;
+    static inline thread_local size_t currentWorker = 0;
+    
+    // Own deque from the back first, then steal from the front of the others
+    bool take(size_t self, bool allowWaiting, Task& out) {
+        {
+            WorkerQueue& own = queues[self];
+            lock_guard<mutex> lock(own.lock);
+            for (auto it = own.tasks.rbegin(); it != own.tasks.rend(); ++it) {
+                if (allowWaiting || !it->mayWait) {
+                    out = move(*it);
+                    own.tasks.erase(next(it).base());
+                    return true;
+                }
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            WorkerQueue& victim = queues[(self + k) % queues.size()];
+            lock_guard<mutex> lock(victim.lock);
+            for (auto it = victim.tasks.begin(); it != victim.tasks.end(); ++it) {
+                if (allowWaiting || !it->mayWait) {
+                    out = move(*it);
+                    victim.tasks.erase(it);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    bool runOne(size_t self, bool allowWaiting) {
+        Task task;
+        if (!take(self, allowWaiting, task)) return false;
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            queued--;
+        }
+        task.run();
+        return true;
+    }
+    
+    void workerLoop(size_t self) {
+        currentPool = this;
+        currentWorker = self;
+        while (true) {
+            if (runOne(self, true)) continue;
+            unique_lock<mutex> lock(sleepMutex);
+            if (stopping && queued == 0) return;
+            workAvailable.wait_for(lock, milliseconds(10), [this] { return stopping || queued > 0; });
+        }
+    }
+};
+
+// Fixed-capacity queue between pipeline stages: push waits while it is full
+// and pop while it is empty, which caps the memory held between stages.
+// After close() pushes fail and pops drain what is left, then fail.
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(max(capacity, (size_t)1)) {}
+    
+    bool push(T item) {
+        unique_lock<mutex> lock(guard);
+        notFull.wait(lock, [this] { return items.size() < capacity || closed; });
+        if (closed) return false;
+        items.push_back(move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+    
+    bool pop(T& item) {
+        unique_lock<mutex> lock(guard);
+        notEmpty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    
+    void close() {
+        {
+            lock_guard<mutex> lock(guard);
+            closed = true;
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+    
+private:
+    size_t capacity;
+    mutex guard;
+    condition_variable notEmpty, notFull;
+    deque<T> items;
+    bool closed = false;
+};
+
+// Writer stage of the compression pipeline: a thread writes buffers in the
+// order they were queued, so the thread collecting encoded blocks never
+// waits on the disk
+class OrderedWriter {
+public:
+    OrderedWriter(ostream& out, size_t depth) : out(out), queue(depth), worker([this] { run(); }) {}
+    ~OrderedWriter() { finish(); }
+    
+    void write(vector<uint8_t> bytes) {
+        queue.push(move(bytes));
+    }
+    
+    // Waits until everything queued is written; returns the nanoseconds
+    // the thread spent in write calls
+    uint64_t finish() {
+        queue.close();
+        if (worker.joinable()) worker.join();
+        return writeTime;
+    }
+    
+    // The thread's writes; complete once finish() has returned
+    const PipelineCounters& counters() const {
+        return written;
+    }
+    
+private:
+    ostream& out;
+    BoundedQueue<vector<uint8_t>> queue;
+    uint64_t writeTime = 0;
+    PipelineCounters written;
+    thread worker;
+    
+    void run() {
+        vector<uint8_t> bytes;
+        while (queue.pop(bytes)) {
+            ScopedTimer timer(writeTime);
+            countedWrite(out, bytes.data(), bytes.size(), written);
+        }
+    }
+};
+
+// Little-endian integer helpers for the HUF2 container
+void putU32(vector<uint8_t>& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back((uint8_t)(value >> (8 * i)));
+}
+
+void putU64(vector<uint8_t>& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out.push_back((uint8_t)(value >> (8 * i)));
+}
+
+void setU32(uint8_t* p, uint32_t value) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+uint32_t getU32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t getU64(const uint8_t* p) {
+    return (uint64_t)getU32(p) | ((uint64_t)getU32(p + 4) << 32);
+}
+
+// LEB128: seven bits per byte, low bits first, high bit set on all but the
+// last. Writes at most 10 bytes and returns how many.
+size_t putVarint(uint8_t* p, uint64_t value) {
+    size_t n = 0;
+    for (; value >= 0x80; value >>= 7) p[n++] = (uint8_t)(value | 0x80);
+    p[n++] = (uint8_t)value;
+    return n;
+}
+
+// Returns the bytes read, or 0 when the varint is cut off or too long
+size_t getVarint(const uint8_t* p, size_t size, uint64_t& value) {
+    value = 0;
+    for (size_t n = 0; n < min(size, (size_t)10); n++) {
+        value |= (uint64_t)(p[n] & 0x7F) << (7 * n);
+        if (!(p[n] & 0x80)) return n == 9 && p[n] > 1 ? 0 : n + 1;
+    }
+    return 0;
+}
+
+// CRC-32C (Castagnoli), the checksum of iSCSI and ext4. x86-64 builds use the
+// SSE4.2 instruction when the CPU has it and ARMv8 builds with the CRC
+// extension use theirs; everything else falls back to slice-by-8 tables.
+class Crc32c {
+public:
+    // Coders checksum their bytes this many at a time, right after touching
+    // them, so the CRC reads from cache instead of a second pass
+    static constexpr size_t kStripe = 64 * 1024;
+    
+    // CRC of data appended to bytes whose CRC is crc (0 for none)
+    static uint32_t update(uint32_t crc, const uint8_t* data, size_t size) {
+        return ~extend(~crc, data, size);
+    }
+    
+    // CRC of A followed by B, from the CRCs of both and the length of B
+    static uint32_t combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB) {
+        // Appending B multiplies A's remainder by x^(8 * lengthB) modulo P
+        uint32_t power = 1u << 31;
+        for (int k = 3; lengthB; lengthB >>= 1, k++) {
+            if (lengthB & 1) power = multiply(power, xPow2(k));
+        }
+        return multiply(power, crcA) ^ crcB;
+    }
+    
+    // The raw register step, for loops that fold the CRC into another pass
+    static uint32_t extend(uint32_t c, const uint8_t* data, size_t size) {
+#if FC_X86_TARGETS
+        if (hardware()) return extendHardware(c, data, size);
+#endif
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) c = step8(c, data + i);
+        for (; i < size; i++) c = step1(c, data[i]);
+        return c;
+    }
+    
+    static uint32_t step1(uint32_t c, uint8_t byte) {
+#ifdef __ARM_FEATURE_CRC32
+        return __crc32cb(c, byte);
+#else
+        return tables()[0][(c ^ byte) & 0xFF] ^ (c >> 8);
+#endif
+    }
+    
+    static uint32_t step8(uint32_t c, const uint8_t* p) {
+#ifdef __ARM_FEATURE_CRC32
+        uint64_t word;
+        memcpy(&word, p, 8);
+        return __crc32cd(c, word);
+#else
+        const uint32_t (*t)[256] = tables();
+        c ^= (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        return t[7][c & 0xFF] ^ t[6][(c >> 8) & 0xFF] ^ t[5][(c >> 16) & 0xFF] ^ t[4][c >> 24] ^
+               t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+#endif
+    }
+    
+#if FC_X86_TARGETS
+    static bool hardware() {
+        static const bool supported = __builtin_cpu_supports("sse4.2");
+        return supported;
+    }
+    
+    __attribute__((target("sse4.2"))) static uint32_t extendHardware(uint32_t c, const uint8_t* data, size_t size) {
+        uint64_t wide = c;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, data + i, 8);
+            wide = _mm_crc32_u64(wide, word);
+        }
+        c = (uint32_t)wide;
+        for (; i < size; i++) c = _mm_crc32_u8(c, data[i]);
+        return c;
+    }
+#endif
+    
+private:
+    static constexpr uint32_t kPolynomial = 0x82F63B78;  // reflected
+    
+    static const uint32_t (*tables())[256] {
+        struct Tables {
+            uint32_t t[8][256];
+            Tables() {
+                for (uint32_t n = 0; n < 256; n++) {
+                    uint32_t c = n;
+                    for (int k = 0; k < 8; k++) c = (c >> 1) ^ (kPolynomial & (0u - (c & 1)));
+                    t[0][n] = c;
+                }
+                for (int k = 1; k < 8; k++) {
+                    for (int n = 0; n < 256; n++) t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xFF];
+                }
+            }
+        };
+        static const Tables tables;
+        return tables.t;
+    }
+    
+    // a * b modulo P, bit-reflected (x^0 is the top bit)
+    static uint32_t multiply(uint32_t a, uint32_t b) {
+        uint32_t product = 0;
+        for (uint32_t m = 1u << 31; m; m >>= 1) {
+            if (a & m) product ^= b;
+            b = (b >> 1) ^ (kPolynomial & (0u - (b & 1)));
+        }
+        return product;
+    }
+    
+    // x^(2^k) modulo P
+    static uint32_t xPow2(int k) {
+        uint32_t p = 1u << 30;
+        for (int i = 0; i < k; i++) p = multiply(p, p);
+        return p;
+    }
+};
+
+inline void countWord(uint32_t banks[4][256], uint64_t word) {
+    banks[0][word & 0xFF]++;
+    banks[1][(word >> 8) & 0xFF]++;
+    banks[2][(word >> 16) & 0xFF]++;
+    banks[3][(word >> 24) & 0xFF]++;
+    banks[0][(word >> 32) & 0xFF]++;
+    banks[1][(word >> 40) & 0xFF]++;
+    banks[2][(word >> 48) & 0xFF]++;
+    banks[3][word >> 56]++;
+}
+
+// One span into the banks while extending the CRC register c
+uint32_t countSpanCrc(const uint8_t* data, size_t span, uint32_t banks[4][256], uint32_t c) {
+    size_t i = 0;
+    for (; i + 8 <= span; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        countWord(banks, word);
+        c = Crc32c::step8(c, data + i);
+    }
+    for (; i < span; i++) {
+        banks[0][data[i]]++;
+        c = Crc32c::step1(c, data[i]);
+    }
+    return c;
+}
+
+#if FC_X86_TARGETS
+__attribute__((target("sse4.2"))) uint32_t countSpanCrcHardware(const uint8_t* data, size_t span,
+                                                                uint32_t banks[4][256], uint32_t c) {
+    uint64_t wide = c;
+    size_t i = 0;
+    for (; i + 8 <= span; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        countWord(banks, word);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    c = (uint32_t)wide;
+    for (; i < span; i++) {
+        banks[0][data[i]]++;
+        c = _mm_crc32_u8(c, data[i]);
+    }
+    return c;
+}
+#endif
+
+// Adds the byte histogram of data to counts. Runs of equal bytes would make
+// every increment wait on the store of the previous one, so bytes are spread
+// over four independent banks of counters and the banks summed at the end.
+// With crc set, the CRC-32C of data is folded into the same pass and
+// appended to *crc, so checksumming costs no extra read of the block.
+void countBytes(const uint8_t* data, size_t size, uint64_t counts[256], uint32_t* crc = nullptr) {
+    // 32-bit banks stay in L1; flush them before they could overflow
+    const size_t kSpan = size_t(1) << 30;
+    uint32_t banks[4][256];
+    uint32_t c = crc ? ~*crc : 0;
+    
+    while (size > 0) {
+        size_t span = min(size, kSpan);
+        memset(banks, 0, sizeof(banks));
+        
+        if (crc) {
+#if FC_X86_TARGETS
+            c = Crc32c::hardware() ? countSpanCrcHardware(data, span, banks, c) : countSpanCrc(data, span, banks, c);
+#else
+            c = countSpanCrc(data, span, banks, c);
+#endif
+        } else {
+            size_t i = 0;
+            for (; i + 8 <= span; i += 8) {
+                uint64_t word;
+                memcpy(&word, data + i, 8);
+                countWord(banks, word);
+            }
+            for (; i < span; i++) banks[0][data[i]]++;
+        }
+        
+        for (int s = 0; s < 256; s++) {
+            counts[s] += (uint64_t)banks[0][s] + banks[1][s] + banks[2][s] + banks[3][s];
+        }
+        data += span;
+        size -= span;
+    }
+    if (crc) *crc = ~c;
+}
+
+// Adds each byte pair to banks[][previous << 8 | byte]; the caller sums the
+// two banks. context is the byte before data, or -1 at the start of the
+// input. As in countBytes, a run of one byte would chain every increment on
+// the same counter, so the halves of data are walked side by side, each
+// into its own bank.
+void countPairs(const uint8_t* data, size_t size, int context, uint64_t banks[2][65536]) {
+    if (size == 0) return;
+    size_t start = context < 0 ? 1 : 0;
+    size_t half = size / 2;
+    unsigned first = context < 0 ? data[0] : (unsigned)context;
+    unsigned second = half ? data[half - 1] : first;
+    const uint8_t* a = data + start;
+    const uint8_t* aEnd = data + half;
+    const uint8_t* b = data + max(half, start);
+    const uint8_t* bEnd = data + size;
+    
+    while (a < aEnd && b < bEnd) {
+        unsigned x = *a++, y = *b++;
+        banks[0][first << 8 | x]++;
+        banks[1][second << 8 | y]++;
+        first = x;
+        second = y;
+    }
+    for (; a < aEnd; a++) {
+        banks[0][first << 8 | *a]++;
+        first = *a;
+    }
+    for (; b < bEnd; b++) {
+        banks[1][second << 8 | *b]++;
+        second = *b;
+    }
+}
+
+// Histogram of a strided sample: run bytes out of every stride * run, spread
+// evenly over data. Returns the number of bytes counted. At most a block is
+// sampled per call, so the 32-bit banks cannot overflow.
+size_t sampleBytes(const uint8_t* data, size_t size, size_t run, size_t stride, uint64_t counts[256]) {
+    uint32_t banks[4][256] = {};
+    size_t counted = 0;
+    for (size_t pos = 0; pos < size; pos += run * stride) {
+        const uint8_t* span = data + pos;
+        size_t n = min(run, size - pos);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t word;
+            memcpy(&word, span + i, 8);
+            countWord(banks, word);
+        }
+        for (; i < n; i++) banks[0][span[i]]++;
+        counted += n;
+    }
+    for (int s = 0; s < 256; s++) {
+        counts[s] += (uint64_t)banks[0][s] + banks[1][s] + banks[2][s] + banks[3][s];
+    }
+    return counted;
+}
+
+// Gear hash table for content-defined chunking: one fixed pseudo-random word
+// per byte value (splitmix64), so cut points are the same on every run
+const uint64_t* gearTable() {
+    static const array<uint64_t, 256> table = [] {
+        array<uint64_t, 256> words;
+        uint64_t x = 0;
+        for (uint64_t& word : words) {
+            uint64_t z = x += 0x9E3779B97F4A7C15ull;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            word = z ^ (z >> 31);
+        }
+        return words;
+    }();
+    return table.data();
+}
+
+// Length of the next content-defined chunk of data (FastCDC). Past minSize,
+// a chunk ends where the top bits of the gear hash, which covers the last
+// 64 bytes, are all clear. Up to 1 << averageBits bytes two more bits must
+// be clear and after it two fewer, which keeps lengths close to the average.
+// An insertion only moves the cut points around it, so the chunks after it
+// still match those of the unchanged data.
+size_t nextChunk(const uint8_t* data, size_t size, size_t minSize, size_t maxSize, int averageBits) {
+    if (size <= minSize) return size;
+    const uint64_t* gear = gearTable();
+    uint64_t strictMask = ~0ull << (64 - averageBits - 2);
+    uint64_t looseMask = ~0ull << (64 - averageBits + 2);
+    size_t limit = min(size, maxSize);
+    size_t average = min(limit, (size_t)1 << averageBits);
+    uint64_t hash = 0;
+    size_t i = minSize;
+    for (; i < average; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & strictMask)) return i + 1;
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (!(hash & looseMask)) return i + 1;
+    }
+    return limit;
+}
+
+// Canonical Huffman codes: shorter codes first, ties broken by byte value.
+// Returns false if the lengths over-subscribe the code space.
+bool assignCanonicalCodes(const uint8_t lengths[256], uint64_t codes[256]) {
+    int lengthCount[65] = {0};
+    for (int s = 0; s < 256; s++) {
+        if (lengths[s] > 64) return false;
+        lengthCount[lengths[s]]++;
+    }
+    lengthCount[0] = 0;
+    
+    uint64_t nextCode[65] = {0};
+    uint64_t code = 0;
+    for (int len = 1; len <= 64; len++) {
+        code = (code + lengthCount[len - 1]) << 1;
+        nextCode[len] = code;
+        if (len < 64 && lengthCount[len] && code + lengthCount[len] > (1ull << len)) return false;
+    }
+    
+    for (int s = 0; s < 256; s++) {
+        codes[s] = lengths[s] ? nextCode[lengths[s]]++ : 0;
+    }
+    return true;
+}
+
+// One HUF2 block record ready to be written, plus what the index and the
+// stats need to know about it
+struct EncodedBlock {
+    vector<uint8_t> record;
+    size_t rawSize = 0;
+    uint32_t crc = 0;  // CRC-32C of the raw bytes
+    bitset<256> symbols;  // for sampled blocks, the bytes seen in the sample
+    StageTimes stages;
+    PipelineCounters counters;
+};
+
+struct DecodedBlock {
+    vector<uint8_t> raw;
+    uint32_t crc = 0;
+    StageTimes stages;
+    PipelineCounters counters;
+};
+
+// One HUF2 block record as read back. Only Huffman records keep their code
+// lengths outside the payload; a stored record's payload is the raw data.
+struct BlockRecord {
+    uint8_t type = 0;
+    size_t rawSize = 0;
+    array<uint8_t, 256> lengths = {};
+    vector<uint8_t> payload;
+    size_t size = 0;  // bytes in the file, type byte included
+    uint32_t crc = 0;
+};
+
+// Block index entry, with the block's position in the decoded data added
+struct BlockIndexEntry {
+    uint64_t offset;
+    uint64_t rawOffset;
+    uint32_t rawSize;
+    uint32_t recordSize;
+};
+
+// Bytes [from, to) of the block at index position block
+struct BlockSlice {
+    size_t block;
+    size_t from;
+    size_t to;
+};
+
+// Decoded blocks shared by the jobs of one archive extraction. Every read
+// of a block is counted before the jobs start; its first reader decodes it
+// and the cache lets go of it at the last, so nothing outlives its readers.
+class BlockCache {
+public:
+    explicit BlockCache(size_t blocks) : entries(blocks) {}
+    
+    void expect(size_t block) {
+        entries[block].readers++;
+    }
+    
+    // The block, from decode(block) if no reader has asked before, in which
+    // case decoded is set; an invalid future if that decode failed
+    template <class F>
+    shared_future<DecodedBlock> take(size_t block, F decode, bool& decoded) {
+        lock_guard<mutex> guard(lock);
+        Entry& entry = entries[block];
+        decoded = !entry.result.valid();
+        if (decoded) entry.result = decode(block);
+        shared_future<DecodedBlock> result = entry.result;
+        if (entry.readers && --entry.readers == 0) entry.result = shared_future<DecodedBlock>();
+        return result;
+    }
+    
+private:
+    struct Entry {
+        size_t readers = 0;
+        shared_future<DecodedBlock> result;
+    };
+    mutex lock;
+    vector<Entry> entries;
+};
+
+// A run of an archive member's bytes at offset in the archive's data stream
+struct ArchiveExtent {
+    uint64_t offset;
+    uint32_t length;
+};
+
+// Directory entry of a HUFA archive. A member is its extents in order; with
+// deduplication, extents of different members can cover the same data.
+struct ArchiveMember {
+    string name;
+    uint64_t size = 0;
+    uint32_t crc = 0;  // CRC-32C of the member's bytes
+    vector<ArchiveExtent> extents;
+};
+
+// Code lengths trained on a sample corpus and kept in a table file. Files
+// coded with it store only its id, and neither side builds codes per block.
+struct SharedTable {
+    uint32_t id = 0;
+    uint8_t lengths[256] = {};
+    uint32_t codes[256] = {};
+    HuffmanDecoder decoder;
+};
+
+// Code lengths for small messages, one hex digit per byte value, trained on
+// English prose, JSON bodies and service logs. Every byte has a code of at
+// most kPrimaryBits bits, so each one decodes in a single probe. Their
+// order gives the kind byte of compressSmall() and is part of the format.
+const SharedTable* builtinTables() {
+    static const char* const kLengths[] = {
+        // text
+        "bbbbbbbbbb7bbbbbbbbbbbbbbbbbbbbb3bb9bbb9887a7778aaabbbbbbb8b9b9b"
+        "b9a8a99b99bba9999b989ababbbbbbba7465546665b8565469444687979bbbbb"
+        "abbbbbbbbbbbbbbbbbbbabbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+        "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbabbbbbbbbbbbbbbbbbbbbbbbbbbbbb",
+        // json
+        "bbbbbbbbbb8bbbbbbbbbbbbbbbbbbbbb5b3bbbbbbbbb568b56566666664bbbbb"
+        "bbbbbbbbbbbbbbbbbbbb8bbbbb88b8b8b576547875b966666955568998b7b7bb"
+        "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+        "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb",
+        // log
+        "bbbbbbbbbb7bbbbbbbbbbbbbbbbbbbbb3b8bbbbbbbbbb57655566666665bb7bb"
+        "b98b8778b8abab779b8a68b9bb77b7bbb5766577659866666b55577888bbbbbb"
+        "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+        "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb",
+    };
+    static SharedTable tables[size(kLengths)];
+    static const bool built = [] {
+        for (size_t t = 0; t < size(kLengths); t++) {
+            uint64_t codes[256];
+            for (int s = 0; s < 256; s++) {
+                char digit = kLengths[t][s];
+                tables[t].lengths[s] = (uint8_t)(digit <= '9' ? digit - '0' : digit - 'a' + 10);
+            }
+            tables[t].id = (uint32_t)t + 1;
+            assignCanonicalCodes(tables[t].lengths, codes);
+            tables[t].decoder.build(codes, tables[t].lengths);
+            for (int s = 0; s < 256; s++) tables[t].codes[s] = (uint32_t)codes[s];
+        }
+        return true;
+    }();
+    (void)built;
+    return tables;
+}
+
+// Entropy backend for literal blocks. Auto takes table ANS where its
+// estimate beats the Huffman code by more than kAnsMinGain.
+enum class EntropyCoder { Auto, Huffman, Ans };
+
+// Match finder settings for one compression level
+struct LzLevel {
+    int windowBits;   // maximum match distance is 1 << windowBits
+    int chainDepth;   // candidates tried per position
+    int niceLength;   // a match this long ends the search
+    bool lazy;        // also try the next position before taking a match
+};
+
+// One LZ step: literalRun literals, then matchLength bytes copied from
+// distance bytes back
+struct LzSequence {
+    uint32_t literalRun;
+    uint32_t matchLength;
+    uint32_t distance;
+};
+
+// A span of input, either pointing into a mapped file or into owned
+// (moving the vector keeps data valid)
+struct InputBlock {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    vector<uint8_t> owned;
+    PipelineCounters counters;  // what the source did to produce it
+};
+
+// One piece of a scattered input, like an iovec
+struct ByteSpan {
+    const uint8_t* data;
+    size_t size;
+};
+
+// Hands out consecutive input blocks; returns false at the end of input
+using BlockSource = function<bool(InputBlock&)>;
+
+// Receives the current step and its percentage; batch jobs call it from
+// several threads at once
+using ProgressCallback = function<void(const string& operation, int percentage)>;
+
+class FileCompressor {
+private:
+    static constexpr size_t kStreamWindow = 4 << 20;
+    static constexpr size_t kDefaultBlockSize = 1 << 20;
+    static constexpr size_t kMaxBlockSize = 64 << 20;
+    static constexpr size_t kMinViewBlock = 64 << 10;  // smaller span pieces are gathered
+    static constexpr size_t kPipelineMinInput = 8 << 20;  // smaller inputs compress in one thread's I/O
+    static constexpr size_t kReadAhead = 4;    // blocks read ahead of the encoders
+    static constexpr size_t kWriteBehind = 8;  // records queued for the writer
+    static constexpr int kMaxCodeLength = 15;  // nibble-packed headers
+    static constexpr int kDefaultCodeLength = HuffmanDecoder::kPrimaryBits;
+    static constexpr uint8_t kFormatVersion = 1;
+    static constexpr uint8_t kBlockHuffman = 0;
+    static constexpr uint8_t kBlockStored = 1;
+    static constexpr uint8_t kBlockLz = 2;
+    static constexpr uint8_t kBlockAns = 3;
+    static constexpr uint8_t kBlockHuffman4 = 4;
+    static constexpr size_t kMinSplitBlock = 4096;
+    static constexpr uint8_t kBlockShared = 5;
+    static constexpr uint8_t kFlagSharedTable = 1;
+    static constexpr uint8_t kTableVersion = 1;
+    static constexpr double kAnsMinGain = 0.01;  // Huffman encodes faster
+    static constexpr size_t kSampleRun = 256;              // bytes per sampled run
+    static constexpr size_t kMinSampledBlock = 64 << 10;   // smaller blocks are counted in full
+    static constexpr double kDefaultSampleLoss = 0.02;
+    static constexpr int kMinMatch = 4;
+    static constexpr int kMaxLevel = 9;
+    static constexpr LzLevel kLzLevels[kMaxLevel + 1] = {
+        {0, 0, 0, false},
+        {16, 4, 16, false}, {16, 8, 32, false}, {16, 32, 32, false},
+        {18, 16, 32, true}, {18, 32, 64, true}, {18, 128, 128, true},
+        {20, 128, 128, true}, {20, 256, 258, true}, {20, 1024, 258, true},
+    };
+    static constexpr uint8_t kBlockEnd = 0xFF;
+    static constexpr uint8_t kArchiveVersion = 1;
+    static constexpr size_t kArchiveHeader = 6;  // "HUFA", version, flags
+    static constexpr size_t kMinChunk = 2 << 10;
+    static constexpr int kChunkBits = 13;         // 8 KB average chunk
+    static constexpr size_t kMaxChunk = 64 << 10;
+    static constexpr uint8_t kSmallStored = 0;   // other kinds name builtinTables()[kind - 1]
+    static constexpr size_t kSmallCostRun = 64 << 10;  // bytes priced before the packed sums could carry
+    static constexpr size_t kSmallSplit = 1024;  // messages this long are coded as four streams
+    
+    mutex progressMutex;
+    ProgressCallback progressCallback;
+    bool showProgress = true;
+    bool quiet = false;
+    size_t blockSize = kDefaultBlockSize;
+    int maxCodeLength = kDefaultCodeLength;
+    int compressionLevel = 0;
+    EntropyCoder entropyCoder = EntropyCoder::Auto;
+    bool splitStreams = true;
+    unsigned sampleRate = 0;  // histogram 1 in sampleRate runs of a block; 0 counts every byte
+    double sampleLoss = kDefaultSampleLoss;
+    bool dedup = false;  // archives store repeated chunks once
+    unique_ptr<SharedTable> sharedTable;
+    atomic<unsigned> activeStreams{0};
+    unsigned threadCount = max(thread::hardware_concurrency(), 1u);
+    unique_ptr<WorkStealingPool> workerPool;
+    
+    // Buffer calls are for embedding: inside one, the running thread reports
+    // only through the progress callback and lastError()
+    static bool& consoleMuted() {
+        static thread_local bool muted = false;
+        return muted;
+    }
+    
+    struct ConsoleMute {
+        bool saved = consoleMuted();
+        ConsoleMute() { consoleMuted() = true; }
+        ~ConsoleMute() { consoleMuted() = saved; }
+    };
+    
+    static string& lastErrorSlot() {
+        static thread_local string error;
+        return error;
+    }
+    
+    // Quiet runs keep stdout for machine-readable output, so their errors go
+    // to stderr without colour
+    void reportError(const string& message) {
+        lastErrorSlot() = message;
+        if (consoleMuted()) return;
+        if (quiet) {
+            cerr << "Error: " << message << endl;
+        } else {
+            cout << RED << "Error: " << message << RESET << endl;
+        }
+    }
+    
+    void displayProgress(const string& operation, int percentage) {
+        if (progressCallback) progressCallback(operation, percentage);
+        if (!showProgress || consoleMuted()) return;
+        lock_guard<mutex> lock(progressMutex);
+        
+        cout << "\r" << CYAN << operation << ": " << RESET;
+        cout << "[";
+        int barWidth = 30;
+        int pos = barWidth * percentage / 100;
+        for (int i = 0; i < barWidth; ++i) {
+            if (i < pos) cout << GREEN << "█" << RESET;
+            else if (i == pos) cout << YELLOW << "█" << RESET;
+            else cout << " ";
+        }
+        cout << "] " << percentage << "%" << flush;
+        if (percentage >= 100) cout << endl;
+    }
+    
+    // Parses a HUF1 tree ('0' internal node, '1' + byte leaf, '#' end) straight
+    // into per-byte codes. Pending right subtrees live on an explicit stack, so
+    // no nodes are allocated and a deep tree cannot overflow the call stack.
+    // A tree with a single leaf is written without its empty right subtree,
+    // in which case its '#' delimiter shows up in that subtree's place.
+    bool readLegacyTree(istream& in, uint64_t codes[256], uint8_t lengths[256], PipelineCounters& counters) {
+        vector<pair<uint64_t, int>> pending;
+        uint64_t code = 0;
+        int len = 0;
+        bool sawDelimiter = false;
+        
+        while (true) {
+            char type;
+            if (!countedRead(in, &type, 1, counters)) return false;
+            if (type == '0') {
+                if (len >= 64) return false;
+                pending.push_back({(code << 1) | 1, len + 1});
+                code <<= 1;
+                len++;
+                continue;
+            }
+            if (type == '#') {
+                sawDelimiter = true;
+                break;
+            }
+            if (type != '1') return false;
+            
+            char ch;
+            if (!countedRead(in, &ch, 1, counters)) return false;
+            codes[(unsigned char)ch] = code;
+            lengths[(unsigned char)ch] = len ? len : 1;
+            
+            if (pending.empty()) break;
+            code = pending.back().first;
+            len = pending.back().second;
+            pending.pop_back();
+        }
+        
+        if (!sawDelimiter) {
+            char delimiter;
+            countedRead(in, &delimiter, 1, counters);
+        }
+        return (bool)in;
+    }
+    
+    string formatFileSize(size_t bytes) {
+        const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+        int unit = 0;
+        double size = bytes;
+        
+        while (size >= 1024 && unit < 4) {
+            size /= 1024;
+            unit++;
+        }
+        
+        return to_string(size).substr(0, 5) + " " + units[unit];
+    }
+    
+    void displayHeader(const string& title) {
+        cout << "\n" << BOLD << BLUE << "╔══════════════════════════════════════════════════════════════════════════════════════════════╗" << RESET << endl;
+        cout << BOLD << BLUE << "║" << setw(46 + title.length()/2) << title << setw(46 - title.length()/2) << "║" << RESET << endl;
+        cout << BOLD << BLUE << "╚══════════════════════════════════════════════════════════════════════════════════════════════╝" << RESET << endl;
+    }
+    
+    // One pass over the blocks on the pool. Each block's histogram gives its
+    // entropy and predicted record size; byte pairs go into order-1 tables
+    // that tasks borrow and hand back, so no 1 MB table is cleared per block
+    // and only one table per running task has to be summed at the end.
+    void analyzeBlocks(const BlockSource& next, size_t total, FileAnalysis& result) {
+        auto startTime = high_resolution_clock::now();
+        struct BlockSummary {
+            array<uint64_t, 256> freq;
+            double entropy;
+            size_t predicted;
+        };
+        
+        mutex tablesMutex;
+        struct PairTable {
+            uint64_t banks[2][65536];
+        };
+        vector<unique_ptr<PairTable>> pairTables;
+        vector<PairTable*> idleTables;
+        auto borrowTable = [&]() {
+            lock_guard<mutex> lock(tablesMutex);
+            if (idleTables.empty()) {
+                pairTables.emplace_back(new PairTable());
+                return pairTables.back().get();
+            }
+            PairTable* table = idleTables.back();
+            idleTables.pop_back();
+            return table;
+        };
+        auto returnTable = [&](PairTable* table) {
+            lock_guard<mutex> lock(tablesMutex);
+            idleTables.push_back(table);
+        };
+        
+        WorkStealingPool& workers = pool();
+        deque<future<BlockSummary>> inFlight;
+        size_t predicted = 0;
+        
+        auto reduceOldest = [&]() {
+            BlockSummary summary = workers.await(inFlight.front());
+            inFlight.pop_front();
+            for (int s = 0; s < 256; s++) result.frequencies[s] += summary.freq[s];
+            result.blockEntropy.push_back(summary.entropy);
+            predicted += summary.predicted + 16;
+        };
+        
+        result = FileAnalysis();
+        result.blockSize = blockSize;
+        int context = -1;
+        InputBlock chunk;
+        while (next(chunk)) {
+            result.size += chunk.size;
+            int last = chunk.data[chunk.size - 1];
+            
+            inFlight.push_back(workers.submit([this, chunk = move(chunk), context, &borrowTable, &returnTable] {
+                BlockSummary summary;
+                summary.freq.fill(0);
+                countBytes(chunk.data, chunk.size, summary.freq.data());
+                summary.entropy = calculateEntropy(summary.freq.data(), chunk.size);
+                summary.predicted = predictBlockSize(summary.freq.data(), chunk.size);
+                
+                PairTable* pairs = borrowTable();
+                countPairs(chunk.data, chunk.size, context, pairs->banks);
+                returnTable(pairs);
+                return summary;
+            }));
+            context = last;
+            if (inFlight.size() >= 2 * workers.size()) reduceOldest();
+            if (total) displayProgress("Analyzing", (int)(100 * min(result.size, total) / total));
+        }
+        while (!inFlight.empty()) reduceOldest();
+        
+        vector<uint64_t> pairs(65536, 0);
+        for (const auto& table : pairTables) {
+            for (int i = 0; i < 65536; i++) pairs[i] += table->banks[0][i] + table->banks[1][i];
+        }
+        result.conditionalEntropy = calculateConditionalEntropy(pairs.data());
+        result.uniqueBytes = (int)count_if(result.frequencies.begin(), result.frequencies.end(),
+                                           [](uint64_t f) { return f != 0; });
+        result.entropy = calculateEntropy(result.frequencies.data(), result.size);
+        result.predictedSize = 10 + 5 + 16 + predicted;  // header, end marker, footer
+        result.processingTime = high_resolution_clock::now() - startTime;
+    }
+    
+    // Size of the record encodeBlock would write at level 0 with Huffman
+    // codes: a Huffman record unless storing is smaller, plus the CRC
+    size_t predictBlockSize(const uint64_t freq[256], size_t size) {
+        if (calculateEntropy(freq, size) * size / 8 + 2 >= size) return 9 + size + 4;
+        
+        uint8_t len[256];
+        buildCodeLengths(freq, len);
+        uint64_t totalBits = 0;
+        int last = 0;
+        for (int s = 0; s < 256; s++) {
+            totalBits += (uint64_t)len[s] * freq[s];
+            if (len[s]) last = s;
+        }
+        bool split = splitStreams && size >= kMinSplitBlock;
+        size_t huffmanSize = 9 + 1 + (last + 2) / 2 + (size_t)((totalBits + 7) / 8) + (split ? 12 + 3 : 0);
+        return min(huffmanSize, 9 + size) + 4;
+    }
+    
+    double calculateEntropy(const uint64_t freq[256], size_t total) {
+        double entropy = 0.0;
+        for (int s = 0; s < 256; s++) {
+            if (!freq[s]) continue;
+            double probability = (double)freq[s] / total;
+            entropy -= probability * log2(probability);
+        }
+        return entropy;
+    }
+    
+    // Entropy of a byte given the byte before it, from order-1 pair counts
+    double calculateConditionalEntropy(const uint64_t pairs[65536]) {
+        double bits = 0;
+        uint64_t total = 0;
+        for (int previous = 0; previous < 256; previous++) {
+            const uint64_t* row = pairs + (previous << 8);
+            uint64_t rowTotal = accumulate(row, row + 256, (uint64_t)0);
+            if (!rowTotal) continue;
+            total += rowTotal;
+            for (int s = 0; s < 256; s++) {
+                if (row[s]) bits -= row[s] * log2((double)row[s] / rowTotal);
+            }
+        }
+        return total ? bits / total : 0.0;
+    }
+    
+    // Block headers store code lengths as nibbles up to the last used byte:
+    // ASCII text needs 65 bytes instead of 256
+    void packLengths(const uint8_t lengths[256], vector<uint8_t>& out) {
+        int last = 255;
+        while (last > 0 && lengths[last] == 0) last--;
+        out.push_back((uint8_t)last);
+        for (int s = 0; s <= last; s += 2) {
+            uint8_t low = (s + 1 <= last) ? lengths[s + 1] : 0;
+            out.push_back((uint8_t)((lengths[s] << 4) | low));
+        }
+    }
+    
+    // Reads a packed length header; returns its size in bytes, 0 on failure
+    size_t readPackedLengths(istream& in, uint8_t lengths[256]) {
+        PipelineCounters counters;
+        return readPackedLengths(in, lengths, counters);
+    }
+    
+    size_t readPackedLengths(istream& in, uint8_t lengths[256], PipelineCounters& counters) {
+        uint8_t last;
+        if (!countedRead(in, &last, 1, counters)) return 0;
+        int count = last + 1;
+        
+        uint8_t packed[128];
+        if (!countedRead(in, packed, (count + 1) / 2, counters)) return 0;
+        
+        memset(lengths, 0, 256);
+        for (int s = 0; s < count; s++) {
+            lengths[s] = (s & 1) ? (packed[s / 2] & 0x0F) : (packed[s / 2] >> 4);
+        }
+        return 1 + (count + 1) / 2;
+    }
+    
+    // ANS headers: u8 tableLog, u8 lastSymbol, then one count per symbol up
+    // to it, one byte below 128 and two (high byte | 0x80 first) otherwise
+    void packCounts(const uint16_t norm[256], int tableLog, vector<uint8_t>& out) {
+        int last = 255;
+        while (last > 0 && norm[last] == 0) last--;
+        out.push_back((uint8_t)tableLog);
+        out.push_back((uint8_t)last);
+        for (int s = 0; s <= last; s++) {
+            if (norm[s] >= 128) out.push_back((uint8_t)(0x80 | (norm[s] >> 8)));
+            out.push_back((uint8_t)norm[s]);
+        }
+    }
+    
+    // Reads counts at pos, advancing it; false unless they fill the table exactly
+    bool readCounts(const vector<uint8_t>& payload, size_t& pos, uint16_t norm[256], int& tableLog) {
+        if (payload.size() - pos < 2) return false;
+        tableLog = payload[pos];
+        int last = payload[pos + 1];
+        pos += 2;
+        if (tableLog < AnsTable::kMinTableLog || tableLog > AnsTable::kMaxTableLog) return false;
+        
+        uint32_t sum = 0;
+        memset(norm, 0, 256 * sizeof(uint16_t));
+        for (int s = 0; s <= last; s++) {
+            if (pos >= payload.size()) return false;
+            uint32_t count = payload[pos++];
+            if (count & 0x80) {
+                if (pos >= payload.size()) return false;
+                count = ((count & 0x7F) << 8) | payload[pos++];
+            }
+            sum += count;
+            if (sum > (1u << tableLog)) return false;
+            norm[s] = (uint16_t)count;
+        }
+        return sum == (1u << tableLog);
+    }
+    
+    // Optimal code lengths of at most maxLength bits (package-merge). Every
+    // level pairs up the cheapest items of the level below into packages and
+    // merges them with the leaves; the 2n - 2 cheapest items of the last
+    // level then contain each symbol once per bit of its code.
+    void packageMerge(const uint64_t freq[256], int maxLength, uint8_t lengths[256]) {
+        struct Item {
+            uint64_t weight;
+            int symbol;       // leaf symbol, or -1 for a package
+            int left, right;  // packaged items
+        };
+        
+        vector<Item> items;
+        vector<int> leaves;
+        for (int s = 0; s < 256; s++) {
+            if (freq[s]) {
+                leaves.push_back((int)items.size());
+                items.push_back(Item{freq[s], s, -1, -1});
+            }
+        }
+        stable_sort(leaves.begin(), leaves.end(), [&](int a, int b) {
+            return items[a].weight < items[b].weight;
+        });
+        
+        memset(lengths, 0, 256);
+        size_t n = leaves.size();
+        if (n == 0) return;
+        if (n == 1) {
+            lengths[items[leaves[0]].symbol] = 1;
+            return;
+        }
+        
+        vector<int> level = leaves;
+        for (int depth = 1; depth < maxLength; depth++) {
+            vector<int> packages;
+            for (size_t i = 0; i + 1 < level.size(); i += 2) {
+                packages.push_back((int)items.size());
+                items.push_back(Item{items[level[i]].weight + items[level[i + 1]].weight, -1, level[i], level[i + 1]});
+            }
+            
+            vector<int> merged;
+            merged.reserve(leaves.size() + packages.size());
+            merge(leaves.begin(), leaves.end(), packages.begin(), packages.end(), back_inserter(merged),
+                  [&](int a, int b) { return items[a].weight < items[b].weight; });
+            level.swap(merged);
+        }
+        
+        vector<int> stack(level.begin(), level.begin() + min(level.size(), 2 * n - 2));
+        while (!stack.empty()) {
+            const Item& item = items[stack.back()];
+            stack.pop_back();
+            if (item.symbol >= 0) {
+                lengths[item.symbol]++;
+            } else {
+                stack.push_back(item.left);
+                stack.push_back(item.right);
+            }
+        }
+    }
+    
+    // Code lengths for one block. A plain Huffman tree is optimal and cheap;
+    // only when it is deeper than the configured limit do we fall back to
+    // package-merge, the optimal length-limited construction.
+    void buildCodeLengths(const uint64_t freq[256], uint8_t lengths[256]) {
+        int used = (int)count_if(freq, freq + 256, [](uint64_t f) { return f != 0; });
+        int limit = maxCodeLength;
+        while ((1 << limit) < used) limit++;
+        
+        HuffmanTree tree;
+        tree.build(freq);
+        if (tree.codeLengths(lengths) > limit) packageMerge(freq, limit, lengths);
+    }
+    
+    // Hash-chain match finder over one block, greedy or with one step of lazy
+    // evaluation. prev only spans the window, so chains stop at its edge.
+    vector<LzSequence> findMatches(const uint8_t* data, size_t size, const LzLevel& level, size_t& trailingLiterals) {
+        const int hashBits = min(max(level.windowBits - 2, 16), 18);
+        size_t window = 1;
+        while (window < size && window < ((size_t)1 << level.windowBits)) window <<= 1;
+        size_t mask = window - 1;
+        vector<int32_t> head((size_t)1 << hashBits, -1);
+        vector<int32_t> prev(window, -1);
+        vector<LzSequence> sequences;
+        
+        auto hashAt = [&](size_t p) {
+            uint32_t v;
+            memcpy(&v, data + p, 4);
+            return (v * 2654435761u) >> (32 - hashBits);
+        };
+        
+        size_t nextInsert = 0;
+        auto insertUpTo = [&](size_t p) {
+            for (; nextInsert < p && nextInsert + kMinMatch <= size; nextInsert++) {
+                uint32_t h = hashAt(nextInsert);
+                prev[nextInsert & mask] = head[h];
+                head[h] = (int32_t)nextInsert;
+            }
+        };
+        
+        auto matchLength = [&](size_t a, size_t b, size_t limit) {
+            size_t n = 0;
+            while (n + 8 <= limit) {
+                uint64_t x, y;
+                memcpy(&x, data + a + n, 8);
+                memcpy(&y, data + b + n, 8);
+                if (x != y) break;
+                n += 8;
+            }
+            while (n < limit && data[a + n] == data[b + n]) n++;
+            return n;
+        };
+        
+        // Searching for something better than an already good match only
+        // walks a quarter of the chain
+        auto findMatch = [&](size_t p, size_t good, uint32_t& bestDistance) -> size_t {
+            size_t best = 0;
+            size_t limit = size - p;
+            int32_t candidate = head[hashAt(p)];
+            int depth = good >= 32 ? max(level.chainDepth / 4, 1) : level.chainDepth;
+            for (; candidate >= 0 && depth > 0; depth--) {
+                size_t distance = p - (size_t)candidate;
+                if (distance > mask) break;
+                if (best < limit && data[candidate + best] == data[p + best]) {
+                    size_t len = matchLength(candidate, p, limit);
+                    if (len > best) {
+                        best = len;
+                        bestDistance = (uint32_t)distance;
+                        if (len >= (size_t)level.niceLength || len == limit) break;
+                    }
+                }
+                candidate = prev[candidate & mask];
+            }
+            return best >= kMinMatch ? best : 0;
+        };
+        
+        size_t pos = 0, anchor = 0;
+        while (pos + kMinMatch <= size) {
+            insertUpTo(pos);
+            uint32_t distance = 0;
+            size_t len = findMatch(pos, 0, distance);
+            if (!len) {
+                pos++;
+                continue;
+            }
+            
+            // Lazy: defer to a longer match starting one byte later
+            while (level.lazy && len < (size_t)level.niceLength && pos + 1 + kMinMatch <= size) {
+                insertUpTo(pos + 1);
+                uint32_t nextDistance = 0;
+                size_t nextLen = findMatch(pos + 1, len, nextDistance);
+                if (nextLen <= len) break;
+                pos++;
+                len = nextLen;
+                distance = nextDistance;
+            }
+            
+            sequences.push_back(LzSequence{(uint32_t)(pos - anchor), (uint32_t)len, distance});
+            pos += len;
+            anchor = pos;
+        }
+        trailingLiterals = size - anchor;
+        return sequences;
+    }
+    
+    // Literal runs and match lengths share one code: 0-7 directly, up to
+    // 1023 as a power-of-two class 8-14 with extra bits, anything longer as
+    // escape 15 with a 5-bit exponent and then the extra bits
+    static uint8_t putLzValue(uint32_t v, BitWriter& extras) {
+        if (v < 8) return (uint8_t)v;
+        int n = 0;
+        while (v >> (n + 1)) n++;
+        if (n < 10) {
+            extras.put(v - (1u << n), n);
+            return (uint8_t)(n + 5);
+        }
+        extras.put((uint32_t)n, 5);
+        extras.put(v - (1u << n), n);
+        return 15;
+    }
+    
+    static uint32_t readBits(BitReader& br, int n) {
+        br.refill();
+        uint32_t v = n ? br.peek(n) : 0;
+        br.consume(n);
+        return v;
+    }
+    
+    static uint32_t readLzValue(uint8_t code, BitReader& extras) {
+        if (code < 8) return code;
+        int n = code == 15 ? (int)readBits(extras, 5) : code - 5;
+        return (1u << n) + readBits(extras, n);
+    }
+    
+    // Huffman-codes a byte stream with its own lengths: packed lengths,
+    // u32 payload size, payload
+    void encodeSubstream(const uint8_t* data, size_t n, vector<uint8_t>& out) {
+        uint64_t freq[256] = {0};
+        countBytes(data, n, freq);
+        uint8_t len[256];
+        buildCodeLengths(freq, len);
+        uint64_t canonical[256];
+        assignCanonicalCodes(len, canonical);
+        
+        uint64_t totalBits = 0;
+        for (int s = 0; s < 256; s++) totalBits += (uint64_t)len[s] * freq[s];
+        size_t bytes = (size_t)((totalBits + 7) / 8);
+        
+        packLengths(len, out);
+        putU32(out, (uint32_t)bytes);
+        size_t start = out.size();
+        out.resize(start + bytes + 4);
+        BitWriter writer(out.data() + start);
+        for (size_t i = 0; i < n; i++) writer.put((uint32_t)canonical[data[i]], len[data[i]]);
+        writer.finish();
+        out.resize(start + bytes);
+    }
+    
+    bool decodeSubstream(istream& in, const vector<uint8_t>& payload, uint8_t* out, size_t n) {
+        uint8_t lengths[256];
+        uint8_t size[4];
+        if (readPackedLengths(in, lengths) == 0 || !in.read(reinterpret_cast<char*>(size), 4)) return false;
+        size_t offset = (size_t)in.tellg();
+        size_t bytes = getU32(size);
+        if (bytes > payload.size() - offset) return false;
+        
+        uint64_t codes[256];
+        HuffmanDecoder decoder;
+        if (!assignCanonicalCodes(lengths, codes) || !decoder.build(codes, lengths)) return false;
+        BitReader br(payload.data() + offset, bytes);
+        in.seekg(offset + bytes);
+        return decoder.decode(br, out, n);
+    }
+    
+    // LZ record payload: u32 literalCount, u32 matchCount, substreams for the
+    // literals, the sequence tokens (literal-run code << 4 | match-length
+    // code) and the distance classes, then u32 size and the extra bits.
+    // A distance d has class floor(log2 d) followed by that many low bits.
+    void encodeLzBlock(const uint8_t* data, size_t size, vector<uint8_t>& record, StageTimes& stages,
+                       PipelineCounters& counters) {
+        size_t trailing;
+        vector<LzSequence> sequences;
+        {
+            ScopedTimer timer(stages.match);
+            sequences = findMatches(data, size, kLzLevels[compressionLevel], trailing);
+        }
+        
+        ScopedTimer timer(stages.encode);
+        vector<uint8_t> literals, tokens, distances;
+        vector<uint8_t> extras(sequences.size() * 12 + 8);
+        literals.reserve(size);
+        tokens.reserve(sequences.size());
+        distances.reserve(sequences.size());
+        BitWriter extraBits(extras.data());
+        
+        const uint8_t* p = data;
+        for (const LzSequence& seq : sequences) {
+            literals.insert(literals.end(), p, p + seq.literalRun);
+            p += seq.literalRun + seq.matchLength;
+            
+            uint8_t runCode = putLzValue(seq.literalRun, extraBits);
+            uint8_t lengthCode = putLzValue(seq.matchLength - kMinMatch, extraBits);
+            tokens.push_back((uint8_t)(runCode << 4 | lengthCode));
+            
+            int distanceClass = 0;
+            while (seq.distance >> (distanceClass + 1)) distanceClass++;
+            distances.push_back((uint8_t)distanceClass);
+            extraBits.put(seq.distance - (1u << distanceClass), distanceClass);
+        }
+        literals.insert(literals.end(), p, p + trailing);
+        extras.resize(extraBits.finish());
+        
+        // One allocation: each substream is at most its lengths, its size and
+        // two bytes per symbol, plus the block CRC encodeBlock appends
+        record.clear();
+        countedReserve(record, 17 + 3 * (129 + 4 + 4) + 2 * (literals.size() + 2 * sequences.size()) + 4 +
+                                   extras.size() + 4, counters);
+        record.push_back(kBlockLz);
+        putU32(record, (uint32_t)size);
+        putU32(record, 0);
+        putU32(record, (uint32_t)literals.size());
+        putU32(record, (uint32_t)sequences.size());
+        if (!literals.empty()) encodeSubstream(literals.data(), literals.size(), record);
+        if (!sequences.empty()) {
+            encodeSubstream(tokens.data(), tokens.size(), record);
+            encodeSubstream(distances.data(), distances.size(), record);
+        }
+        putU32(record, (uint32_t)extras.size());
+        record.insert(record.end(), extras.begin(), extras.end());
+        
+        setU32(record.data() + 5, (uint32_t)(record.size() - 9));
+    }
+    
+    // Rebuilds an LZ block; raw is empty on corruption
+    DecodedBlock decodeLzBlock(const vector<uint8_t>& payload, size_t rawSize) {
+        DecodedBlock block;
+        if (payload.size() < 8) return block;
+        size_t literalCount = getU32(payload.data());
+        size_t matchCount = getU32(payload.data() + 4);
+        if (literalCount > rawSize || matchCount > rawSize / kMinMatch) return block;
+        
+        vector<uint8_t> literals(literalCount), tokens(matchCount), distances(matchCount);
+        MemoryBuf buf(payload.data(), payload.size());
+        istream in(&buf);
+        in.seekg(8);
+        {
+            ScopedTimer timer(block.stages.tableBuild);
+            if (literalCount && !decodeSubstream(in, payload, literals.data(), literalCount)) return block;
+            if (matchCount && (!decodeSubstream(in, payload, tokens.data(), matchCount) ||
+                               !decodeSubstream(in, payload, distances.data(), matchCount))) {
+                return block;
+            }
+        }
+        
+        ScopedTimer timer(block.stages.decode);
+        uint8_t size[4];
+        if (!in.read(reinterpret_cast<char*>(size), 4)) return block;
+        size_t offset = (size_t)in.tellg();
+        size_t extraSize = getU32(size);
+        if (extraSize > payload.size() - offset) return block;
+        BitReader extras(payload.data() + offset, extraSize);
+        
+        countedResize(block.raw, rawSize, block.counters);
+        uint8_t* out = block.raw.data();
+        size_t pos = 0, literal = 0;
+        size_t checked = 0;  // output covered by crc, a stripe at a time
+        uint32_t crc = ~0u;
+        for (size_t i = 0; i < matchCount; i++) {
+            size_t run = readLzValue(tokens[i] >> 4, extras);
+            size_t length = (size_t)readLzValue(tokens[i] & 15, extras) + kMinMatch;
+            int distanceClass = distances[i];
+            size_t distance = distanceClass < 32 ? (1u << distanceClass) + readBits(extras, distanceClass) : 0;
+            
+            if (run > literalCount - literal || run + length > rawSize - pos ||
+                distance == 0 || distance > pos + run) {
+                block.raw.clear();
+                return block;
+            }
+            memcpy(out + pos, literals.data() + literal, run);
+            pos += run;
+            literal += run;
+            
+            // Overlapping copies (distance < length) repeat the last bytes
+            const uint8_t* from = out + pos - distance;
+            if (distance >= length) {
+                memcpy(out + pos, from, length);
+            } else {
+                for (size_t k = 0; k < length; k++) out[pos + k] = from[k];
+            }
+            pos += length;
+            if (pos - checked >= Crc32c::kStripe) {
+                crc = Crc32c::extend(crc, out + checked, pos - checked);
+                checked = pos;
+            }
+        }
+        
+        if (literalCount - literal != rawSize - pos) {
+            block.raw.clear();
+            return block;
+        }
+        memcpy(out + pos, literals.data() + literal, rawSize - pos);
+        block.crc = ~Crc32c::extend(crc, out + checked, rawSize - checked);
+        return block;
+    }
+    
+    // Record holding the block's bytes as they are
+    void storeBlock(const uint8_t* data, size_t size, EncodedBlock& block) {
+        ScopedTimer timer(block.stages.encode);
+        vector<uint8_t>& record = block.record;
+        record.clear();
+        countedReserve(record, 9 + size + 4, block.counters);
+        record.push_back(kBlockStored);
+        putU32(record, (uint32_t)size);
+        putU32(record, (uint32_t)size);
+        record.insert(record.end(), data, data + size);
+    }
+    
+    // ANS record payload: the normalized counts, u8 padBits, then the state
+    // stream (see AnsEncoder::encode)
+    void encodeAnsBlock(const uint8_t* data, size_t size, const uint16_t norm[256], int tableLog,
+                        EncodedBlock& block) {
+        AnsEncoder encoder;
+        vector<uint8_t>& record = block.record;
+        size_t headerSize;
+        {
+            ScopedTimer timer(block.stages.header);
+            encoder.build(norm, tableLog);
+            
+            // One allocation: the largest header, the stream bound and the CRC
+            record.clear();
+            countedReserve(record, 9 + 2 + 512 + 1 + encoder.bound(size) + 4, block.counters);
+            record.push_back(kBlockAns);
+            putU32(record, (uint32_t)size);
+            putU32(record, 0);
+            packCounts(norm, tableLog, record);
+            record.push_back(0);
+            headerSize = record.size();
+            record.resize(headerSize + encoder.bound(size));
+        }
+        
+        ScopedTimer timer(block.stages.encode);
+        int padBits;
+        size_t bytes = encoder.encode(data, size, record.data() + record.size(), padBits);
+        memmove(record.data() + headerSize, record.data() + record.size() - bytes, bytes);
+        record.resize(headerSize + bytes);
+        record[headerSize - 1] = (uint8_t)padBits;
+        uint32_t payloadSize = (uint32_t)(record.size() - 9);
+        for (int i = 0; i < 4; i++) record[5 + i] = (uint8_t)(payloadSize >> (8 * i));
+    }
+    
+    DecodedBlock decodeAnsBlock(const vector<uint8_t>& payload, size_t rawSize) {
+        DecodedBlock block;
+        uint16_t norm[256];
+        int tableLog;
+        size_t pos = 0;
+        AnsDecoder decoder;
+        {
+            ScopedTimer timer(block.stages.tableBuild);
+            if (!readCounts(payload, pos, norm, tableLog) || pos >= payload.size() || payload[pos] > 7) {
+                return block;
+            }
+            decoder.build(norm, tableLog);
+        }
+        
+        ScopedTimer timer(block.stages.decode);
+        int padBits = payload[pos++];
+        countedResize(block.raw, rawSize, block.counters);
+        BitReader br(payload.data() + pos, payload.size() - pos);
+        br.refill();
+        br.consume(padBits);
+        uint32_t crc = ~0u;
+        decoder.decode(br, block.raw.data(), rawSize, Crc32c::kStripe,
+                       [&crc](const uint8_t* data, size_t size) { crc = Crc32c::extend(crc, data, size); });
+        block.crc = ~crc;
+        return block;
+    }
+    
+    // Encodes one self-contained HUF2 block record, which ends with the
+    // CRC-32C of the raw bytes. Runs on pool threads, so it must not touch
+    // shared state.
+    EncodedBlock encodeBlock(const uint8_t* data, size_t size) {
+        EncodedBlock block = encodeRecord(data, size);
+        
+        // The size checks above work on estimates; never exceed a stored
+        // record, which compressBound() relies on
+        if (block.record.size() > 9 + size) storeBlock(data, size, block);
+        putU32(block.record, block.crc);
+        return block;
+    }
+    
+    // The record without its CRC; the histogram pass computes block.crc
+    EncodedBlock encodeRecord(const uint8_t* data, size_t size) {
+        EncodedBlock block;
+        block.rawSize = size;
+        if (sharedTable) {
+            {
+                ScopedTimer timer(block.stages.checksum);
+                block.crc = Crc32c::update(0, data, size);
+            }
+            encodeSharedBlock(data, size, block);
+            return block;
+        }
+        
+        // Sampling only replaces the histogram of level-0 Huffman blocks: LZ
+        // levels spend their time matching, and ANS sizes need exact counts
+        uint64_t freq[256] = {0};
+        bool counted = false;
+        if (sampleRate && size >= kMinSampledBlock && compressionLevel == 0 && entropyCoder != EntropyCoder::Ans) {
+            if (encodeSampledBlock(data, size, block, freq, counted)) return block;
+            block.record.clear();
+            block.symbols.reset();
+            FC_STAT(block.counters.resampledBlocks++);
+        }
+        
+        if (!counted) {
+            ScopedTimer timer(block.stages.histogram);
+            countBytes(data, size, freq, &block.crc);
+        }
+        for (int s = 0; s < 256; s++) block.symbols[s] = freq[s] != 0;
+        
+        // With an LZ level set, the LZ record competes with the plain
+        // Huffman and stored forms; the smallest wins
+        vector<uint8_t> lzRecord;
+        if (compressionLevel > 0) encodeLzBlock(data, size, lzRecord, block.stages, block.counters);
+        auto storeOrLz = [&]() {
+            if (!lzRecord.empty() && lzRecord.size() < 9 + size) {
+                block.record = move(lzRecord);
+            } else {
+                storeBlock(data, size, block);
+            }
+        };
+        
+        // No order-0 code beats the entropy, and a Huffman record adds at
+        // least a two-byte length header: already-compressed or random data
+        // is stored without building codes
+        if (calculateEntropy(freq, size) * size / 8 + 2 >= size) {
+            storeOrLz();
+            return block;
+        }
+        
+        uint8_t len[256];
+        {
+            ScopedTimer timer(block.stages.codeLengths);
+            buildCodeLengths(freq, len);
+        }
+        
+        uint32_t code[256];
+        size_t payloadSize, headerSize;
+        vector<uint8_t>& record = block.record;
+        {
+            ScopedTimer timer(block.stages.header);
+            uint64_t canonical[256];
+            assignCanonicalCodes(len, canonical);
+            
+            uint64_t totalBits = 0;
+            for (int s = 0; s < 256; s++) {
+                code[s] = (uint32_t)canonical[s];
+                totalBits += (uint64_t)len[s] * freq[s];
+            }
+            payloadSize = (size_t)((totalBits + 7) / 8);
+        }
+        
+        // The packed header is the last-symbol byte plus one nibble per symbol;
+        // split payloads add the jump table and up to three bytes of padding
+        int last = 255;
+        while (last > 0 && len[last] == 0) last--;
+        bool split = splitStreams && size >= kMinSplitBlock;
+        size_t huffmanSize = 9 + 1 + (last + 2) / 2 + payloadSize + (split ? 12 + 3 : 0);
+        
+        // Table ANS spends fractional bits per byte, which pays off on skewed
+        // blocks where every Huffman code is rounded up to whole bits
+        uint16_t norm[256];
+        int tableLog = 0;
+        size_t ansSize = SIZE_MAX;
+        if (entropyCoder != EntropyCoder::Huffman) {
+            ScopedTimer timer(block.stages.codeLengths);
+            tableLog = AnsTable::tableLogFor(size, (int)block.symbols.count());
+            AnsTable::normalize(freq, size, tableLog, norm);
+            double bits = AnsTable::cost(freq, norm, tableLog) + 2 * tableLog;
+            ansSize = 9 + 3 + (size_t)ceil(bits / 8);
+            for (int s = 0; s <= last; s++) ansSize += norm[s] >= 128 ? 2 : 1;
+        }
+        bool useAns = entropyCoder == EntropyCoder::Ans ||
+                      (entropyCoder == EntropyCoder::Auto && ansSize < huffmanSize * (1 - kAnsMinGain));
+        size_t entropySize = useAns ? ansSize : huffmanSize;
+        if (entropySize >= 9 + size || (!lzRecord.empty() && entropySize >= lzRecord.size())) {
+            storeOrLz();
+            return block;
+        }
+        if (useAns) {
+            encodeAnsBlock(data, size, norm, tableLog, block);
+            return block;
+        }
+        
+        {
+            ScopedTimer timer(block.stages.header);
+            
+            // One allocation: the largest header plus the payload and writer slack
+            size_t bound = split ? 12 + payloadSize + 3 : payloadSize;
+            countedReserve(record, 9 + 129 + bound + 8, block.counters);
+            record.push_back(split ? kBlockHuffman4 : kBlockHuffman);
+            putU32(record, (uint32_t)size);
+            putU32(record, (uint32_t)payloadSize);
+            packLengths(len, record);
+            
+            headerSize = record.size();
+            record.resize(headerSize + bound + 8);
+        }
+        
+        ScopedTimer timer(block.stages.encode);
+        payloadSize = writeStreams(data, size, code, len, split, record.data() + headerSize);
+        setU32(record.data() + 5, (uint32_t)payloadSize);
+        record.resize(headerSize + payloadSize);
+        return block;
+    }
+    
+    // Huffman record coded from a 1/sampleRate sample of the block. The
+    // exact histogram and the CRC are taken while coding, a stripe at a time
+    // as the encoder leaves it in cache, so each byte is read from memory
+    // once. Returns false with exact unset when the sample looks
+    // incompressible (the full count decides on storing) or when the escape
+    // codes cost the sample more than sampleLoss; or with exact set, the
+    // counts in freq and block.crc, when the payload is more than sampleLoss
+    // over the optimal code for those counts.
+    bool encodeSampledBlock(const uint8_t* data, size_t size, EncodedBlock& block, uint64_t freq[256],
+                            bool& exact) {
+        uint64_t sample[256] = {0};
+        size_t counted;
+        {
+            ScopedTimer timer(block.stages.histogram);
+            counted = sampleBytes(data, size, kSampleRun, sampleRate, sample);
+        }
+        if (calculateEntropy(sample, counted) * size / 8 + 2 >= size) return false;
+        
+        uint8_t len[256];
+        uint32_t code[256];
+        {
+            ScopedTimer timer(block.stages.codeLengths);
+            uint8_t plain[256];
+            buildCodeLengths(sample, plain);
+            escapeCodeLengths(sample, counted, len);
+            uint64_t canonical[256];
+            assignCanonicalCodes(len, canonical);
+            uint64_t sampleBits = 0, plainBits = 0;
+            for (int s = 0; s < 256; s++) {
+                code[s] = (uint32_t)canonical[s];
+                sampleBits += (uint64_t)len[s] * sample[s];
+                plainBits += (uint64_t)plain[s] * sample[s];
+            }
+            
+            // With few distinct bytes the escape leaf can cost a whole bit on
+            // a common one; the exact count needs no escapes
+            if (sampleBits > plainBits * (1 + sampleLoss)) return false;
+        }
+        
+        // Without the exact histogram the payload size is known only after
+        // coding, so room is made for the longest code on every byte
+        bool split = splitStreams && size >= kMinSplitBlock;
+        int longest = *max_element(len, len + 256);
+        size_t bound = (split ? 12 + 3 : 0) + (size * longest + 7) / 8;
+        size_t headerSize;
+        vector<uint8_t>& record = block.record;
+        {
+            ScopedTimer timer(block.stages.header);
+            countedReserve(record, 9 + 129 + bound + 8, block.counters);
+            record.push_back(split ? kBlockHuffman4 : kBlockHuffman);
+            putU32(record, (uint32_t)size);
+            putU32(record, 0);
+            packLengths(len, record);
+            headerSize = record.size();
+            record.resize(headerSize + bound + 8);
+        }
+        
+        size_t payloadSize;
+        {
+            ScopedTimer timer(block.stages.encode);
+            auto count = [&](const uint8_t* stripe, size_t n) { countBytes(stripe, n, freq, &block.crc); };
+            payloadSize =
+                writeStreams(data, size, code, len, split, record.data() + headerSize, Crc32c::kStripe, count);
+            exact = true;
+        }
+        for (int s = 0; s < 256; s++) block.symbols[s] = freq[s] != 0;
+        
+        uint64_t optimalBits = 0;
+        {
+            ScopedTimer timer(block.stages.codeLengths);
+            uint8_t optimal[256];
+            buildCodeLengths(freq, optimal);
+            for (int s = 0; s < 256; s++) optimalBits += (uint64_t)optimal[s] * freq[s];
+        }
+        double allowedBits = optimalBits * (1 + sampleLoss) + 8 * (split ? 12 + 3 + 4 : 1);
+        if (payloadSize * 8.0 > allowedBits || headerSize + payloadSize >= 9 + size) return false;
+        setU32(record.data() + 5, (uint32_t)payloadSize);
+        record.resize(headerSize + payloadSize);
+        FC_STAT(block.counters.sampledBlocks++);
+        return true;
+    }
+    
+    // Code lengths for a sampled histogram that keep every byte encodable.
+    // Giving each byte the sample missed a leaf of its own within
+    // maxCodeLength would take up to a tenth of the code space from the bytes
+    // that matter. Instead they share one escape leaf, whose subtree is then
+    // split into codes up to kMaxCodeLength long; the escape weight is
+    // doubled until that subtree fits.
+    void escapeCodeLengths(uint64_t freq[256], size_t counted, uint8_t lengths[256]) {
+        vector<int> missing;
+        for (int s = 0; s < 256; s++) {
+            if (!freq[s]) missing.push_back(s);
+        }
+        if (missing.empty()) {
+            buildCodeLengths(freq, lengths);
+            return;
+        }
+        
+        int depth = 0;
+        while ((size_t(1) << depth) < missing.size()) depth++;
+        int escape = missing[0];
+        for (uint64_t weight = max<uint64_t>(counted >> (kMaxCodeLength - depth), 1); ; weight *= 2) {
+            freq[escape] = weight;
+            buildCodeLengths(freq, lengths);
+            if (lengths[escape] + depth <= kMaxCodeLength) break;
+        }
+        freq[escape] = 0;
+        
+        // A complete subtree: the first leaves one level up, the rest at depth
+        size_t shallow = (size_t(1) << depth) - missing.size();
+        int base = lengths[escape];
+        for (size_t i = 0; i < missing.size(); i++) {
+            lengths[missing[i]] = (uint8_t)(base + depth - (i < shallow ? 1 : 0));
+        }
+    }
+    
+    // Writes a Huffman payload and returns its size: one stream or, split,
+    // u32 sizes of the first three streams and then four streams coding
+    // consecutive quarters of the block. dst needs 8 bytes of slack. The
+    // encoder kernel is picked once per block by the longest code; shorter
+    // codes flush less often. done sees the coded bytes in order, a stripe at
+    // a time (see encodeSymbols).
+    template <class Done = IgnoreStripes>
+    size_t writeStreams(const uint8_t* data, size_t size, const uint32_t code[256], const uint8_t len[256],
+                        bool split, uint8_t* dst, size_t stripe = SIZE_MAX, Done done = Done()) {
+        int longest = *max_element(len, len + 256);
+        if (longest <= 8) return writeStreamsFor<8>(data, size, code, len, split, dst, stripe, done);
+        if (longest <= HuffmanDecoder::kPrimaryBits) {
+            return writeStreamsFor<HuffmanDecoder::kPrimaryBits>(data, size, code, len, split, dst, stripe, done);
+        }
+        return writeStreamsFor<kMaxCodeLength>(data, size, code, len, split, dst, stripe, done);
+    }
+    
+    template <int MaxLen, class Done = IgnoreStripes>
+    static size_t writeStreamsFor(const uint8_t* data, size_t size, const uint32_t code[256], const uint8_t len[256],
+                                  bool split, uint8_t* dst, size_t stripe = SIZE_MAX, Done done = Done()) {
+        if (!split) return encodeSymbols<MaxLen>(data, size, code, len, dst, stripe, done);
+        
+        size_t quarter = (size + 3) / 4;
+        uint8_t* stream = dst + 12;
+        for (int k = 0; k < 4; k++) {
+            size_t begin = min(k * quarter, size);
+            size_t bytes = encodeSymbols<MaxLen>(data + begin, min(quarter, size - begin), code, len, stream,
+                                                 stripe, done);
+            if (k < 3) setU32(dst + 4 * k, (uint32_t)bytes);
+            stream += bytes;
+        }
+        return stream - dst;
+    }
+    
+    // Shared-table record payload: u8 stream count (1 or 4), then the streams
+    // as written by writeStreams. Without a histogram there is no size check
+    // up front, so a block the table codes badly is stored afterwards.
+    void encodeSharedBlock(const uint8_t* data, size_t size, EncodedBlock& block) {
+        const SharedTable& table = *sharedTable;
+        bool split = splitStreams && size >= kMinSplitBlock;
+        int longest = *max_element(table.lengths, table.lengths + 256);
+        size_t bound = (split ? 12 + 3 : 0) + (size * longest + 7) / 8;
+        vector<uint8_t>& record = block.record;
+        {
+            ScopedTimer timer(block.stages.header);
+            countedReserve(record, 10 + bound + 8, block.counters);
+            record.push_back(kBlockShared);
+            putU32(record, (uint32_t)size);
+            putU32(record, 0);
+            record.push_back(split ? 4 : 1);
+            record.resize(10 + bound + 8);
+        }
+        
+        size_t payloadSize;
+        {
+            ScopedTimer timer(block.stages.encode);
+            payloadSize = 1 + writeStreams(data, size, table.codes, table.lengths, split, record.data() + 10);
+        }
+        if (payloadSize >= size) {
+            storeBlock(data, size, block);
+            return;
+        }
+        setU32(record.data() + 5, (uint32_t)payloadSize);
+        record.resize(9 + payloadSize);
+    }
+    
+    DecodedBlock decodeSharedBlock(const vector<uint8_t>& payload, size_t rawSize) {
+        DecodedBlock block;
+        if (!sharedTable || payload.empty() || (payload[0] != 1 && payload[0] != 4)) return block;
+        
+        ScopedTimer timer(block.stages.decode);
+        countedResize(block.raw, rawSize, block.counters);
+        if (!readStreams(sharedTable->decoder, payload.data() + 1, payload.size() - 1, block.raw.data(), rawSize,
+                         payload[0] == 4, &block.crc)) {
+            block.raw.clear();
+        }
+        return block;
+    }
+    
+    // FNV-1a over the code lengths identifies a table
+    static uint32_t tableId(const uint8_t lengths[256]) {
+        uint32_t hash = 2166136261u;
+        for (int s = 0; s < 256; s++) hash = (hash ^ lengths[s]) * 16777619u;
+        return hash;
+    }
+    
+    // Files coded with a shared table name it by id right after the header
+    bool checkTableReference(istream& in, uint8_t flags, PipelineCounters& counters) {
+        if (!(flags & kFlagSharedTable)) return true;
+        uint8_t id[4];
+        if (!countedRead(in, id, sizeof(id), counters)) {
+            reportError("Truncated compressed file!");
+            return false;
+        }
+        if (!sharedTable || sharedTable->id != getU32(id)) {
+            char name[16];
+            snprintf(name, sizeof(name), "%08x", getU32(id));
+            reportError(string("File needs shared table ") + name + "!");
+            return false;
+        }
+        return true;
+    }
+    
+    // Decodes a payload laid out by writeStreams; false on corruption. With
+    // crc set the output is decoded a stripe at a time and each stripe is
+    // checksummed while still in cache; *crc gets the CRC-32C of all of it.
+    static bool readStreams(const HuffmanDecoder& decoder, const uint8_t* payload, size_t payloadSize, uint8_t* out,
+                            size_t rawSize, bool split, uint32_t* crc = nullptr) {
+        if (!split) {
+            BitReader br(payload, payloadSize);
+            if (!crc) return decoder.decode(br, out, rawSize);
+            uint32_t c = ~0u;
+            for (size_t pos = 0; pos < rawSize; pos += Crc32c::kStripe) {
+                size_t n = min(Crc32c::kStripe, rawSize - pos);
+                if (!decoder.decode(br, out + pos, n)) return false;
+                c = Crc32c::extend(c, out + pos, n);
+            }
+            *crc = ~c;
+            return true;
+        }
+        
+        if (payloadSize < 12) return false;
+        size_t streamSize[4];
+        size_t remaining = payloadSize - 12;
+        for (int k = 0; k < 3; k++) {
+            streamSize[k] = getU32(payload + 4 * k);
+            if (streamSize[k] > remaining) return false;
+            remaining -= streamSize[k];
+        }
+        streamSize[3] = remaining;
+        
+        size_t quarter = (rawSize + 3) / 4;
+        const uint8_t* stream = payload + 12;
+        BitReader readers[4] = {{stream, 0}, {stream, 0}, {stream, 0}, {stream, 0}};
+        uint8_t* starts[4];
+        size_t count[4];
+        for (int k = 0; k < 4; k++) {
+            readers[k] = BitReader(stream, streamSize[k]);
+            stream += streamSize[k];
+            starts[k] = out + min(k * quarter, rawSize);
+            count[k] = min((k + 1) * quarter, rawSize) - min(k * quarter, rawSize);
+        }
+        if (!crc) return decoder.decode4(readers, starts, count);
+        
+        // The streams advance side by side a quarter stripe each; their CRCs
+        // are joined in output order at the end
+        uint32_t c[4] = {~0u, ~0u, ~0u, ~0u};
+        const size_t step = Crc32c::kStripe / 4;
+        for (size_t done = 0; done < quarter; done += step) {
+            uint8_t* at[4];
+            size_t n[4];
+            for (int k = 0; k < 4; k++) {
+                at[k] = starts[k] + min(done, count[k]);
+                n[k] = count[k] > done ? min(step, count[k] - done) : 0;
+            }
+            if (!decoder.decode4(readers, at, n)) return false;
+            for (int k = 0; k < 4; k++) c[k] = Crc32c::extend(c[k], at[k], n[k]);
+        }
+        *crc = ~c[0];
+        for (int k = 1; k < 4; k++) *crc = Crc32c::combine(*crc, ~c[k], count[k]);
+        return true;
+    }
+    
+    // Decodes a block payload given its code lengths; raw is empty on
+    // corruption
+    DecodedBlock decodeBlock(const uint8_t lengths[256], const vector<uint8_t>& payload, size_t rawSize,
+                             bool split) {
+        DecodedBlock block;
+        uint64_t codes[256];
+        HuffmanDecoder decoder;
+        {
+            ScopedTimer timer(block.stages.tableBuild);
+            if (*max_element(lengths, lengths + 256) > 32 ||
+                !assignCanonicalCodes(lengths, codes) || !decoder.build(codes, lengths)) {
+                return block;
+            }
+        }
+        
+        ScopedTimer timer(block.stages.decode);
+        countedResize(block.raw, rawSize, block.counters);
+        if (!readStreams(decoder, payload.data(), payload.size(), block.raw.data(), rawSize, split, &block.crc)) {
+            block.raw.clear();
+        }
+        return block;
+    }
+    
+    WorkStealingPool& pool() {
+        if (!workerPool || workerPool->size() != threadCount) {
+            workerPool.reset();
+            workerPool.reset(new WorkStealingPool(threadCount));
+        }
+        return *workerPool;
+    }
+    
+    // Bytes left in a seekable stream, 0 when that cannot be told (pipes)
+    size_t streamRemaining(istream& in) {
+        streampos here = in.tellg();
+        if (here == streampos(-1)) {
+            in.clear();
+            return 0;
+        }
+        in.seekg(0, ios::end);
+        streampos end = in.tellg();
+        in.seekg(here);
+        return end > here ? (size_t)(end - here) : 0;
+    }
+    
+    // Blocks copied out of a stream with large reads
+    BlockSource streamBlocks(istream& in, size_t size) {
+        return [&in, size](InputBlock& block) {
+            countedResize(block.owned, size, block.counters);
+            countedRead(in, block.owned.data(), size, block.counters);
+            block.owned.resize((size_t)in.gcount());
+            block.data = block.owned.data();
+            block.size = block.owned.size();
+            return block.size != 0;
+        };
+    }
+    
+    // Blocks that are views into the mapping; no copies are made, the pages
+    // are faulted in by whichever worker reads them
+    BlockSource mappedBlocks(const MappedFile& file, size_t size) {
+#ifdef _WIN32
+        return memoryBlocks(file.data(), file.size(), size);
+#else
+        // Ask for the pages kReadAhead blocks ahead, so the kernel reads them
+        // while the workers encode what is resident
+        BlockSource blocks = memoryBlocks(file.data(), file.size(), size);
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        return [&file, size, page, blocks](InputBlock& block) {
+            if (!blocks(block)) return false;
+            size_t ahead = (size_t)(block.data - file.data()) + kReadAhead * size;
+            if (ahead < file.size()) {
+                size_t start = ahead / page * page;
+                madvise(const_cast<uint8_t*>(file.data()) + start, min(size, file.size() - start), MADV_WILLNEED);
+            }
+            return true;
+        };
+#endif
+    }
+    
+    // Reader stage of the compression pipeline: a thread pulls up to depth
+    // blocks from source ahead of the caller, so a blocking read (a pipe, a
+    // network filesystem) overlaps the encoding of earlier blocks
+    BlockSource prefetchBlocks(BlockSource source, size_t depth) {
+        struct Reader {
+            BoundedQueue<InputBlock> queue;
+            thread worker;
+            explicit Reader(size_t depth) : queue(depth) {}
+            ~Reader() {
+                queue.close();
+                if (worker.joinable()) worker.join();
+            }
+        };
+        auto reader = make_shared<Reader>(depth);
+        reader->worker = thread([queue = &reader->queue, source = move(source)] {
+            InputBlock block;
+            while (source(block) && queue->push(move(block))) block = InputBlock();
+            queue->close();
+        });
+        return [reader](InputBlock& block) { return reader->queue.pop(block); };
+    }
+    
+    // Blocks that are views into a caller's buffer, which must outlive the call
+    BlockSource memoryBlocks(const uint8_t* data, size_t total, size_t size) {
+        size_t pos = 0;
+        return [data, total, size, pos](InputBlock& block) mutable {
+            block.owned.clear();
+            block.data = data + pos;
+            block.size = min(size, total - pos);
+            pos += block.size;
+            FC_STAT(block.counters.bytesRead += block.size);
+            return block.size != 0;
+        };
+    }
+    
+    // Blocks over a list of caller buffers. A block that fits inside one
+    // buffer is a view into it; pieces shorter than kMinViewBlock are copied
+    // together into an owned block, so small buffers do not make small blocks.
+    BlockSource gatherBlocks(const vector<ByteSpan>& parts, size_t size) {
+        size_t part = 0, pos = 0;
+        return [&parts, size, part, pos](InputBlock& block) mutable {
+            while (part < parts.size() && pos == parts[part].size) {
+                part++;
+                pos = 0;
+            }
+            if (part == parts.size()) return false;
+            
+            block.owned.clear();
+            size_t left = parts[part].size - pos;
+            if (left >= min(size, kMinViewBlock)) {
+                block.data = parts[part].data + pos;
+                block.size = min(size, left);
+                pos += block.size;
+                FC_STAT(block.counters.bytesRead += block.size);
+                return true;
+            }
+            countedReserve(block.owned, size, block.counters);
+            while (block.owned.size() < size && part < parts.size()) {
+                size_t take = min(size - block.owned.size(), parts[part].size - pos);
+                block.owned.insert(block.owned.end(), parts[part].data + pos, parts[part].data + pos + take);
+                pos += take;
+                if (pos == parts[part].size) {
+                    part++;
+                    pos = 0;
+                }
+            }
+            block.data = block.owned.data();
+            block.size = block.owned.size();
+            FC_STAT(block.counters.bytesRead += block.size);
+            return true;
+        };
+    }
+    
+    // HUF1 files: one serialized tree and one bitstream, decoded serially
+    bool decompressLegacy(istream& in, ostream& out, CompressionStats& stats) {
+        displayProgress("Reconstructing tree", 30);
+        
+        uint64_t codes[256] = {0};
+        uint8_t lengths[256] = {0};
+        size_t originalSize;
+        HuffmanDecoder decoder;
+        bool treeOk;
+        {
+            ScopedTimer timer(stats.stages.tableBuild);
+            treeOk = readLegacyTree(in, codes, lengths, stats.counters) &&
+                     countedRead(in, &originalSize, sizeof(originalSize), stats.counters) &&
+                     decoder.build(codes, lengths);
+        }
+        if (!treeOk) {
+            reportError("Corrupted Huffman tree!");
+            return false;
         }
+        int maxLength = *max_element(lengths, lengths + 256);
         
-        displayProgress("Reading compressed file", 10);
+        displayProgress("Decoding data", 60);
         
-        // Check magic number
-        char magic[5];
-        in.read(magic, 4);
-        magic[4] = '\0';
+        // Padding bits are zeros and the decoder stops at originalSize, so the
+        // packed payload can be decoded as-is
+        char padding;
+        countedRead(in, &padding, 1, stats.counters);
+        
+        vector<uint8_t> window, chunk;
+        countedResize(window, kStreamWindow, stats.counters);
+        countedResize(chunk, 1 << 20, stats.counters);
+        BitReader br(window.data(), 0);
+        bool inputDone = false;
+        size_t decodedChars = 0;
         
-        if (string(magic) != "HUF1") {
-            cout << RED << "Error: Invalid file format!" << RESET << endl;
+        while (decodedChars < originalSize) {
+            // Slide the unread tail to the front and top the window up. The
+            // bytes behind buffered bits move along, and the reader restarts
+            // on them, since the fast decode kernels re-read them.
+            size_t held = br.pos < br.end ? (size_t)(br.bitCount + 7) / 8 : 0;
+            int skip = held ? (8 - br.bitCount % 8) % 8 : 0;
+            size_t unread = br.end - br.pos + held;
+            memmove(window.data(), br.pos - held, unread);
+            if (!inputDone) {
+                ScopedTimer timer(stats.stages.read);
+                inputDone = !countedRead(in, window.data() + unread, window.size() - unread, stats.counters);
+                unread += (size_t)in.gcount();
+            }
+            if (held) {
+                br = BitReader(window.data(), unread);
+                br.refill();
+                br.consume(skip);
+            } else {
+                br.pos = window.data();
+                br.end = window.data() + unread;
+            }
+            
+            // Until the input is exhausted, only decode as many symbols as the
+            // window is guaranteed to hold, keeping 16 bytes of refill slack
+            size_t n = min(chunk.size(), originalSize - decodedChars);
+            if (!inputDone) {
+                size_t safe = unread > 16 ? (unread - 16) * 8 / max(maxLength, 1) : 0;
+                n = min(n, safe);
+            }
+            
+            bool ok;
+            {
+                ScopedTimer timer(stats.stages.decode);
+                ok = decoder.decode(br, chunk.data(), n);
+            }
+            if (!ok) {
+                reportError("Corrupted compressed data!");
+                return false;
+            }
+            {
+                ScopedTimer timer(stats.stages.write);
+                countedWrite(out, chunk.data(), n, stats.counters);
+            }
+            FC_STAT(stats.counters.blocks++);
+            decodedChars += n;
+            
+            displayProgress("Writing output", 60 + (int)(39 * decodedChars / max(originalSize, (size_t)1)));
+        }
+        return true;
+    }
+    
+    // Reads the record at the current position; the end marker reads as a
+    // record of type kBlockEnd. False, after reporting, on a bad record.
+    bool readRecord(istream& in, size_t fileBlockSize, BlockRecord& record, PipelineCounters& counters) {
+        if (!countedRead(in, &record.type, 1, counters)) {
+            reportError("Truncated compressed file!");
             return false;
         }
+        record.size = 1;
+        if (record.type == kBlockEnd) return true;
         
-        displayProgress("Reconstructing tree", 30);
+        uint8_t sizes[8];
+        countedRead(in, sizes, sizeof(sizes), counters);
+        size_t rawSize = getU32(sizes);
+        size_t payloadSize = getU32(sizes + 4);
         
-        Node* root = readTree(in);
-        char delimiter;
-        in.get(delimiter);
+        bool stored = record.type == kBlockStored;
+        bool split = record.type == kBlockHuffman4;
+        bool huffman = record.type == kBlockHuffman || split;
+        bool typeOk = huffman || stored || record.type == kBlockLz || record.type == kBlockAns ||
+                      record.type == kBlockShared;
+        if (!in || !typeOk || rawSize == 0 || rawSize > fileBlockSize ||
+            payloadSize > rawSize * 4 + 8 || (stored && payloadSize != rawSize)) {
+            reportError("Corrupted block header!");
+            return false;
+        }
         
-        size_t originalSize;
-        in.read(reinterpret_cast<char*>(&originalSize), sizeof(originalSize));
+        size_t headerSize = huffman ? readPackedLengths(in, record.lengths.data(), counters) : 0;
+        countedResize(record.payload, payloadSize, counters);
+        uint8_t crc[4];
+        if (!countedRead(in, record.payload.data(), payloadSize, counters) ||
+            !countedRead(in, crc, sizeof(crc), counters) || (huffman && headerSize == 0)) {
+            reportError("Truncated compressed file!");
+            return false;
+        }
+        record.rawSize = rawSize;
+        record.crc = getU32(crc);
+        record.size = 9 + headerSize + payloadSize + sizeof(crc);
+        return true;
+    }
+    
+    // Decodes a record on the pool. Stored records are the output already;
+    // they queue up behind the blocks still decoding as a ready future.
+    future<DecodedBlock> submitRecord(BlockRecord record) {
+        if (record.type == kBlockStored) {
+            promise<DecodedBlock> ready;
+            DecodedBlock block;
+            block.raw = move(record.payload);
+            {
+                ScopedTimer timer(block.stages.checksum);
+                block.crc = Crc32c::update(0, block.raw.data(), block.raw.size());
+            }
+            checkBlockCrc(block, record.crc);
+            ready.set_value(move(block));
+            return ready.get_future();
+        }
+        return pool().submit([this, record = move(record)] {
+            DecodedBlock block;
+            if (record.type == kBlockLz) {
+                block = decodeLzBlock(record.payload, record.rawSize);
+            } else if (record.type == kBlockAns) {
+                block = decodeAnsBlock(record.payload, record.rawSize);
+            } else if (record.type == kBlockShared) {
+                block = decodeSharedBlock(record.payload, record.rawSize);
+            } else {
+                block = decodeBlock(record.lengths.data(), record.payload, record.rawSize,
+                                    record.type == kBlockHuffman4);
+            }
+            checkBlockCrc(block, record.crc);
+            return block;
+        });
+    }
+    
+    // The decoders compute block.crc as they write the output; a mismatch
+    // empties raw like any other corruption
+    static void checkBlockCrc(DecodedBlock& block, uint32_t expected) {
+        if (block.crc != expected) block.raw.clear();
+    }
+    
+    // HUF2 files: blocks are read in order, decoded on the pool and written
+    // back in order. The trailing index is not needed for a sequential pass.
+    bool decompressBlocks(istream& in, ostream& out, CompressionStats& stats) {
+        size_t totalInput = streamRemaining(in);
         
-        displayProgress("Decoding data", 60);
+        uint8_t header[6];
+        if (!countedRead(in, header, sizeof(header), stats.counters) || header[0] != kFormatVersion) {
+            reportError("Unsupported HUF2 version!");
+            return false;
+        }
+        size_t fileBlockSize = getU32(header + 2);
+        if (!checkTableReference(in, header[1], stats.counters)) return false;
         
-        char padding;
-        in.get(padding);
+        WorkStealingPool& workers = pool();
+        deque<future<DecodedBlock>> inFlight;
+        size_t maxInFlight = 2 * workers.size();
+        size_t consumed = sizeof(header) + (header[1] & kFlagSharedTable ? 4 : 0);
+        uint32_t fileCrc = 0;
+        
+        auto writeOldest = [&]() {
+            DecodedBlock block = workers.await(inFlight.front());
+            inFlight.pop_front();
+            stats.stages += block.stages;
+            stats.counters += block.counters;
+            if (block.raw.empty()) return false;
+            fileCrc = Crc32c::combine(fileCrc, block.crc, block.raw.size());
+            
+            ScopedTimer timer(stats.stages.write);
+            countedWrite(out, block.raw.data(), block.raw.size(), stats.counters);
+            return true;
+        };
+        
+        displayProgress("Decoding blocks", 10);
+        
+        while (true) {
+            BlockRecord record;
+            {
+                ScopedTimer timer(stats.stages.read);
+                if (!readRecord(in, fileBlockSize, record, stats.counters)) return false;
+            }
+            if (record.type == kBlockEnd) break;
+            consumed += record.size;
+            FC_STAT(stats.counters.blocks++);
+            inFlight.push_back(submitRecord(move(record)));
+            
+            if (inFlight.size() >= maxInFlight && !writeOldest()) {
+                reportError("Corrupted compressed data!");
+                return false;
+            }
+            if (totalInput) displayProgress("Decoding blocks", 10 + (int)(89 * min(consumed, totalInput) / totalInput));
+        }
+        
+        uint8_t expectedCrc[4];
+        if (!countedRead(in, expectedCrc, sizeof(expectedCrc), stats.counters)) {
+            reportError("Truncated compressed file!");
+            return false;
+        }
         
-        string bitString;
-        char byte;
-        while (in.get(byte)) {
-            bitset<8> b(byte);
-            bitString += b.to_string();
+        while (!inFlight.empty()) {
+            if (!writeOldest()) {
+                reportError("Corrupted compressed data!");
+                return false;
+            }
+        }
+        if (fileCrc != getU32(expectedCrc)) {
+            reportError("Checksum mismatch!");
+            return false;
         }
+        return true;
+    }
+    
+    // Loads the header and trailing block index of a seekable HUF2 stream
+    // positioned at its start; false when the index is missing or does not
+    // match the file
+    bool readBlockIndex(istream& in, uint8_t& flags, size_t& fileBlockSize, vector<BlockIndexEntry>& index,
+                        PipelineCounters& counters) {
+        size_t fileSize = streamRemaining(in);
+        uint8_t header[10];
+        uint8_t footer[16];
+        if (fileSize < sizeof(header) + 1 + sizeof(footer)) return false;
+        countedRead(in, header, sizeof(header), counters);
+        in.seekg(fileSize - sizeof(footer));
+        if (!countedRead(in, footer, sizeof(footer), counters) || memcmp(header, "HUF2", 4) != 0 || memcmp(footer + 12, "HUF2", 4) != 0) return false;
         
-        // Remove padding
-        if (padding != 8) {
-            bitString = bitString.substr(0, bitString.size() - padding);
+        flags = header[5];
+        fileBlockSize = getU32(header + 6);
+        uint64_t count = getU32(footer);
+        uint64_t indexOffset = getU64(footer + 4);
+        size_t indexEnd = fileSize - sizeof(footer);
+        if (header[4] != kFormatVersion || indexOffset < sizeof(header) + 5 ||
+            indexOffset > indexEnd || indexEnd - indexOffset != count * 16) {
+            return false;
         }
         
-        displayProgress("Writing output", 85);
+        vector<uint8_t> entries((size_t)count * 16);
+        in.seekg(indexOffset);
+        if (!countedRead(in, entries.data(), entries.size(), counters)) return false;
         
-        Node* curr = root;
-        size_t decodedChars = 0;
+        // Records lie between the header and the end marker with the file CRC
+        uint64_t recordsEnd = indexOffset - 5;
+        uint64_t rawOffset = 0;
+        index.clear();
+        index.reserve((size_t)count);
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t* p = entries.data() + 16 * i;
+            BlockIndexEntry entry = {getU64(p), rawOffset, getU32(p + 8), getU32(p + 12)};
+            if (entry.offset < sizeof(header) || entry.offset > recordsEnd || entry.recordSize > recordsEnd - entry.offset ||
+                entry.rawSize == 0 || entry.rawSize > fileBlockSize) {
+                return false;
+            }
+            index.push_back(entry);
+            rawOffset += entry.rawSize;
+        }
+        return true;
+    }
+    
+    // Single pass over the input: each block is read, encoded on the pool and
+    // written in order, so memory is bounded by the blocks in flight and the
+    // input may be a pipe such as cin.
+    //
+    // HUF2 layout (integers little-endian):
+    //   header  "HUF2" u8 version, u8 flags, u32 blockSize, then u32 table id
+    //           when flags has kFlagSharedTable
+    //   block*  u8 type, u32 rawSize, u32 payloadSize, then
+    //             kBlockHuffman: code lengths, payload
+    //             (lengths: u8 lastSymbol, then lastSymbol + 1 nibbles, high first)
+    //             kBlockStored:  the rawSize bytes as they are
+    //             kBlockLz:      literals and match sequences (see encodeLzBlock)
+    //             kBlockAns:     normalized counts and table-ANS stream (see
+    //                            encodeAnsBlock)
+    //             kBlockHuffman4: code lengths, u32 sizes of streams 0-2, then
+    //                            four streams, one per quarter
+    //             kBlockShared:  streams coded with the shared table (see
+    //                            encodeSharedBlock)
+    //           then u32 CRC-32C of the rawSize bytes
+    //   end     u8 kBlockEnd, then u32 CRC-32C of the whole input
+    //   index   per block: u64 offset, u32 rawSize, u32 recordSize
+    //   footer  u32 blockCount, u64 indexOffset, "HUF2"
+    //
+    // onBlock receives the number of input bytes consumed so far. Pipelined,
+    // a writer thread does the writes (see OrderedWriter), so reading and
+    // handing out blocks go on while records reach the disk.
+    CompressionStats compressStream(const BlockSource& next, ostream& out, const function<void(size_t)>& onBlock,
+                                    bool pipelined = false) {
+        auto startTime = high_resolution_clock::now();
+        CompressionStats stats = CompressionStats();
+        stats.algorithm = "Huffman Coding";
+        activeStreams++;
+        
+        unique_ptr<OrderedWriter> writer;
+        if (pipelined) writer.reset(new OrderedWriter(out, kWriteBehind));
+        auto emit = [&](vector<uint8_t>&& bytes, uint64_t& stage) {
+            if (writer) {
+                writer->write(move(bytes));
+                return;
+            }
+            ScopedTimer timer(stage);
+            countedWrite(out, bytes.data(), bytes.size(), stats.counters);
+        };
+        
+        vector<uint8_t> header = {'H', 'U', 'F', '2', kFormatVersion, sharedTable ? kFlagSharedTable : (uint8_t)0};
+        putU32(header, (uint32_t)blockSize);
+        if (sharedTable) putU32(header, sharedTable->id);
+        uint64_t offset = header.size();
+        emit(move(header), stats.stages.write);
+        
+        WorkStealingPool& workers = pool();
+        deque<future<EncodedBlock>> inFlight;
+        vector<uint8_t> index;
+        uint32_t blockCount = 0;
+        uint32_t fileCrc = 0;
+        bool seen[256] = {false};
         
-        for (char bit : bitString) {
-            if (decodedChars >= originalSize) break;
+        auto writeOldest = [&]() {
+            EncodedBlock block = workers.await(inFlight.front());
+            inFlight.pop_front();
+            size_t recordSize = block.record.size();
             
-            if (bit == '0') curr = curr->left;
-            else curr = curr->right;
+            putU64(index, offset);
+            putU32(index, (uint32_t)block.rawSize);
+            putU32(index, (uint32_t)recordSize);
+            for (int s = 0; s < 256; s++) seen[s] |= block.symbols[s];
+            fileCrc = Crc32c::combine(fileCrc, block.crc, block.rawSize);
             
-            if (!curr->left && !curr->right) {
-                out.put(curr->ch);
-                curr = root;
-                decodedChars++;
+            emit(move(block.record), block.stages.write);
+            stats.stages += block.stages;
+            stats.counters += block.counters;
+            FC_STAT(stats.counters.blocks++);
+            offset += recordSize;
+            blockCount++;
+        };
+        
+        InputBlock block;
+        while (true) {
+            block.counters = PipelineCounters();
+            {
+                ScopedTimer timer(stats.stages.read);
+                if (!next(block)) break;
             }
+            stats.originalSize += block.size;
+            stats.counters += block.counters;
+            
+            inFlight.push_back(workers.submit([this, block = move(block)] {
+                return encodeBlock(block.data, block.size);
+            }));
+            
+            // Concurrent streams (batch jobs) share the pool, so each keeps
+            // a proportional number of blocks in flight
+            size_t maxInFlight = max<size_t>(2, 2 * workers.size() / max(activeStreams.load(), 1u));
+            while (inFlight.size() >= maxInFlight) writeOldest();
+            
+            onBlock(stats.originalSize);
         }
+        while (!inFlight.empty()) writeOldest();
         
-        displayProgress("Decompression complete", 100);
+        // End marker, index and footer go out in one write
+        vector<uint8_t> tail = {kBlockEnd};
+        putU32(tail, fileCrc);
+        uint64_t indexOffset = offset + tail.size();
+        tail.insert(tail.end(), index.begin(), index.end());
+        putU32(tail, blockCount);
+        putU64(tail, indexOffset);
+        tail.insert(tail.end(), {'H', 'U', 'F', '2'});
+        offset += tail.size();
+        emit(move(tail), stats.stages.write);
+        if (writer) {
+            stats.stages.write += writer->finish();
+            stats.counters += writer->counters();
+        }
+        {
+            ScopedTimer timer(stats.stages.write);
+            out.flush();
+        }
+        
+        stats.compressedSize = offset;
+        stats.uniqueChars = (int)count(seen, seen + 256, true);
+        activeStreams--;
+        
+        auto endTime = high_resolution_clock::now();
+        stats.processingTime = duration_cast<duration<double>>(endTime - startTime);
+        
+        stats.compressionRatio = stats.originalSize ? (double)stats.compressedSize / stats.originalSize : 0;
+        stats.spaceSavings = (1.0 - stats.compressionRatio) * 100;
+        
+        return stats;
+    }
+    
+    // Reports message and returns stats that carry it
+    CompressionStats failedStats(const string& message) {
+        reportError(message);
+        CompressionStats stats = CompressionStats();
+        stats.error = message;
+        return stats;
+    }
+    
+    // Compresses straight from a mapping of inputFile when possible, else
+    // through a buffered stream. outputFile is only created once the input
+    // is open; on failure the stats carry the error.
+    // Pipelined, a mapped file still needs no reader thread: the workers
+    // fault its pages in, behind the read-ahead of mappedBlocks
+    CompressionStats compressFile(const string& inputFile, const string& outputFile,
+                                  const function<void(size_t)>& onBlock, bool pipelined) {
+        MappedFile mapped;
+        ifstream in;
+        if (!mapped.open(inputFile)) in.open(inputFile, ios::binary);
+        if (!mapped.data() && !in) return failedStats("Cannot open " + inputFile);
+        ofstream out(outputFile, ios::binary);
+        if (!out) return failedStats("Cannot create " + outputFile);
+        
+        CompressionStats stats;
+        if (mapped.data()) {
+            stats = compressStream(mappedBlocks(mapped, blockSize), out, onBlock, pipelined);
+        } else {
+            BlockSource blocks = streamBlocks(in, blockSize);
+            if (pipelined) blocks = prefetchBlocks(move(blocks), kReadAhead);
+            stats = compressStream(blocks, out, onBlock, pipelined);
+        }
+        if (!out.flush()) return failedStats("Cannot write " + outputFile);
+        return stats;
+    }
+    
+    // Maps archiveFile, or reads it into loaded where it cannot be mapped,
+    // and parses its directory
+    bool openArchive(const string& archiveFile, MappedFile& mapped, vector<uint8_t>& loaded, ByteSpan& archive,
+                     ByteSpan& store, vector<ArchiveMember>& members) {
+        if (!mapped.open(archiveFile)) {
+            ifstream in(archiveFile, ios::binary);
+            if (!in) {
+                reportError("Cannot open " + archiveFile);
+                return false;
+            }
+            loaded.resize(streamRemaining(in));
+            in.read(reinterpret_cast<char*>(loaded.data()), loaded.size());
+        }
+        archive = mapped.data() ? ByteSpan{mapped.data(), mapped.size()} : ByteSpan{loaded.data(), loaded.size()};
+        if (!readArchive(archive.data, archive.size, store, members)) {
+            reportError("Missing or corrupted archive directory!");
+            return false;
+        }
+        return true;
+    }
+    
+    // Splits a HUFA archive into its HUF2 data stream and its directory
+    bool readArchive(const uint8_t* data, size_t size, ByteSpan& store, vector<ArchiveMember>& members) {
+        const size_t footerSize = 16;
+        if (size < kArchiveHeader + footerSize || memcmp(data, "HUFA", 4) != 0 ||
+            memcmp(data + size - 4, "HUFA", 4) != 0 || data[4] != kArchiveVersion) {
+            return false;
+        }
+        const uint8_t* footer = data + size - footerSize;
+        uint64_t count = getU32(footer);
+        uint64_t directoryOffset = getU64(footer + 4);
+        size_t directoryEnd = size - footerSize;
+        if (directoryOffset < kArchiveHeader || directoryOffset + 4 > directoryEnd) return false;
+        
+        // The directory ends with its own CRC
+        const uint8_t* p = data + directoryOffset;
+        const uint8_t* end = data + directoryEnd - 4;
+        if (Crc32c::update(0, p, end - p) != getU32(end)) return false;
+        
+        auto take = [&](size_t n) {
+            if ((size_t)(end - p) < n) return (const uint8_t*)nullptr;
+            const uint8_t* field = p;
+            p += n;
+            return field;
+        };
+        members.clear();
+        for (uint64_t i = 0; i < count; i++) {
+            ArchiveMember member;
+            const uint8_t* field = take(4);
+            if (!field) return false;
+            size_t nameLength = getU32(field);
+            const uint8_t* name = take(nameLength);
+            const uint8_t* fixed = take(16);
+            if (!name || !fixed) return false;
+            member.name.assign(reinterpret_cast<const char*>(name), nameLength);
+            member.size = getU64(fixed);
+            member.crc = getU32(fixed + 8);
+            uint64_t extents = getU32(fixed + 12);
+            if (extents > (size_t)(end - p) / 12) return false;
+            member.extents.resize((size_t)extents);
+            for (ArchiveExtent& extent : member.extents) {
+                const uint8_t* e = take(12);
+                extent = {getU64(e), getU32(e + 8)};
+            }
+            members.push_back(move(member));
+        }
+        if (p != end) return false;
+        
+        store = {data + kArchiveHeader, (size_t)directoryOffset - kArchiveHeader};
+        return true;
+    }
+    
+public:
+    CompressionStats compress(const string& inputFile, const string& outputFile) {
+        if (!fileExists(inputFile)) return failedStats("Cannot open " + inputFile);
+        size_t totalInput = getFileSize(inputFile);
+        displayProgress("Reading file", 10);
+        
+        CompressionStats stats = compressFile(inputFile, outputFile, [&](size_t done) {
+            if (totalInput) displayProgress("Encoding blocks", 10 + (int)(89 * min(done, totalInput) / totalInput));
+        }, totalInput >= kPipelineMinInput);
+        if (!stats.error.empty()) return stats;
+        
+        displayProgress("Compression complete", 100);
+        return stats;
+    }
+    
+    // Streaming compression with memory bounded by the blocks in flight;
+    // works on pipes such as cin/cout, which are pipelined as their size is
+    // unknown
+    CompressionStats compress(istream& in, ostream& out) {
+        size_t totalInput = streamRemaining(in);
+        bool pipelined = totalInput == 0 || totalInput >= kPipelineMinInput;
+        
+        displayProgress("Reading file", 10);
+        
+        BlockSource blocks = streamBlocks(in, blockSize);
+        if (pipelined) blocks = prefetchBlocks(move(blocks), kReadAhead);
+        CompressionStats stats = compressStream(blocks, out, [&](size_t done) {
+            if (totalInput) displayProgress("Encoding blocks", 10 + (int)(89 * min(done, totalInput) / totalInput));
+        }, pipelined);
+        
+        displayProgress("Compression complete", 100);
+        
+        return stats;
+    }
+    
+    bool decompress(const string& inputFile, const string& outputFile, CompressionStats* stats = nullptr) {
+        auto startTime = high_resolution_clock::now();
+        
+        // A mapped file is decoded in place of the ifstream's buffered reads
+        MappedFile mapped;
+        ifstream file;
+        if (!mapped.open(inputFile)) file.open(inputFile, ios::binary);
+        MemoryBuf mappedBuf(mapped.data(), mapped.size());
+        istream mappedIn(&mappedBuf);
+        istream& in = mapped.data() ? mappedIn : file;
+        ofstream out(outputFile, ios::binary);
+        
+        if (!in || !out) {
+            reportError("Cannot open files!");
+            return false;
+        }
+        
+        if (!decompress(in, out, stats)) return false;
         
-        in.close();
         out.close();
         
         auto endTime = high_resolution_clock::now();
         auto processingTime = duration_cast<duration<double>>(endTime - startTime);
         
-        cout << GREEN << "\n✓ File decompressed successfully!" << RESET << endl;
-        cout << "⏱️  Processing time: " << fixed << setprecision(3) << processingTime.count() << " seconds" << endl;
+        if (!quiet) {
+            cout << GREEN << "\n✓ File decompressed successfully!" << RESET << endl;
+            cout << "⏱️  Processing time: " << fixed << setprecision(3) << processingTime.count() << " seconds" << endl;
+        }
+        
+        return true;
+    }
+    
+    // Slices of the blocks that make up bytes [offset, end) of the decoded
+    // data, which must lie within it
+    static void appendSlices(const vector<BlockIndexEntry>& index, uint64_t offset, uint64_t end,
+                             vector<BlockSlice>& slices) {
+        // First block ending past offset
+        auto first = upper_bound(index.begin(), index.end(), offset, [](uint64_t value, const BlockIndexEntry& e) {
+            return value < e.rawOffset + e.rawSize;
+        });
+        for (auto entry = first; entry != index.end() && entry->rawOffset < end; ++entry) {
+            size_t from = (size_t)(max(offset, entry->rawOffset) - entry->rawOffset);
+            size_t to = (size_t)(min(end, entry->rawOffset + entry->rawSize) - entry->rawOffset);
+            slices.push_back({(size_t)(entry - index.begin()), from, to});
+        }
+    }
+    
+    // Writes the slices in order, reading and decoding each block once for a
+    // run of slices in the same block. With a cache, blocks are taken from it
+    // and decoded only by their first reader. The CRC-32C of the bytes
+    // written is folded into crc when given.
+    bool writeSlices(istream& in, size_t fileBlockSize, const vector<BlockIndexEntry>& index,
+                     const vector<BlockSlice>& slices, ostream& out, CompressionStats& local, uint32_t* crc = nullptr,
+                     BlockCache* cache = nullptr) {
+        WorkStealingPool& workers = pool();
+        deque<pair<shared_future<DecodedBlock>, bool>> inFlight;  // the block, and whether this call decodes it
+        size_t maxInFlight = 2 * workers.size();
+        size_t nextWrite = 0;
+        
+        auto writeOldest = [&]() {
+            const DecodedBlock& block = workers.await(inFlight.front().first);
+            if (inFlight.front().second) {
+                local.stages += block.stages;
+                local.counters += block.counters;
+            }
+            size_t current = slices[nextWrite].block;
+            bool intact = block.raw.size() == index[current].rawSize;
+            
+            ScopedTimer timer(local.stages.write);
+            for (; intact && nextWrite < slices.size() && slices[nextWrite].block == current; nextWrite++) {
+                const BlockSlice& slice = slices[nextWrite];
+                countedWrite(out, block.raw.data() + slice.from, slice.to - slice.from, local.counters);
+                if (!crc) continue;
+                if (slice.from == 0 && slice.to == block.raw.size()) {
+                    *crc = Crc32c::combine(*crc, block.crc, block.raw.size());
+                } else {
+                    *crc = Crc32c::update(*crc, block.raw.data() + slice.from, slice.to - slice.from);
+                }
+            }
+            inFlight.pop_front();
+            return intact;
+        };
+        
+        auto decode = [&](size_t block) {
+            const BlockIndexEntry& entry = index[block];
+            BlockRecord record;
+            {
+                ScopedTimer timer(local.stages.read);
+                in.seekg(entry.offset);
+                if (!readRecord(in, fileBlockSize, record, local.counters)) return shared_future<DecodedBlock>();
+            }
+            if (record.type == kBlockEnd || record.size != entry.recordSize || record.rawSize != entry.rawSize) {
+                reportError("Block index does not match the blocks!");
+                return shared_future<DecodedBlock>();
+            }
+            FC_STAT(local.counters.blocks++);
+            return submitRecord(move(record)).share();
+        };
+        
+        for (size_t i = 0; i < slices.size(); i++) {
+            if (i && slices[i].block == slices[i - 1].block) continue;
+            bool decodes = true;
+            shared_future<DecodedBlock> block = cache ? cache->take(slices[i].block, decode, decodes)
+                                                      : decode(slices[i].block);
+            if (!block.valid()) return false;
+            inFlight.push_back({move(block), decodes});
+            
+            if (inFlight.size() >= maxInFlight && !writeOldest()) {
+                reportError("Corrupted compressed data!");
+                return false;
+            }
+        }
+        while (!inFlight.empty()) {
+            if (!writeOldest()) {
+                reportError("Corrupted compressed data!");
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Writes bytes [offset, offset + length) of the original data, clipped to
+    // its end. Only the blocks overlapping the range are read and decoded, so
+    // the cost follows the range rather than the file. HUF2 only; in must be
+    // seekable.
+    bool decompressRange(istream& in, ostream& out, uint64_t offset, uint64_t length,
+                         CompressionStats* stats = nullptr) {
+        auto startTime = high_resolution_clock::now();
+        CompressionStats local = CompressionStats();
+        local.algorithm = "Huffman Coding";
+        size_t inputSize = streamRemaining(in);
+        
+        uint8_t flags;
+        size_t fileBlockSize;
+        vector<BlockIndexEntry> index;
+        {
+            ScopedTimer timer(local.stages.read);
+            if (!readBlockIndex(in, flags, fileBlockSize, index, local.counters)) {
+                reportError("Missing or corrupted block index!");
+                return false;
+            }
+            in.seekg(10);
+            if (!checkTableReference(in, flags, local.counters)) return false;
+        }
+        
+        uint64_t total = index.empty() ? 0 : index.back().rawOffset + index.back().rawSize;
+        if (offset > total) {
+            reportError("Range starts past the end of the data!");
+            return false;
+        }
+        vector<BlockSlice> slices;
+        appendSlices(index, offset, offset + min(length, total - offset), slices);
+        if (!writeSlices(in, fileBlockSize, index, slices, out, local)) return false;
+        out.flush();
+        
+        if (stats) {
+            local.processingTime = duration_cast<duration<double>>(high_resolution_clock::now() - startTime);
+            local.originalSize = local.counters.bytesWritten;
+            local.compressedSize = inputSize ? inputSize : local.counters.bytesRead;
+            local.compressionRatio = local.originalSize ? (double)local.compressedSize / local.originalSize : 0;
+            local.spaceSavings = (1.0 - local.compressionRatio) * 100;
+            *stats = local;
+        }
+        return true;
+    }
+    
+    bool decompressRange(const string& inputFile, const string& outputFile, uint64_t offset, uint64_t length,
+                         CompressionStats* stats = nullptr) {
+        MappedFile mapped;
+        ifstream file;
+        if (!mapped.open(inputFile)) file.open(inputFile, ios::binary);
+        MemoryBuf mappedBuf(mapped.data(), mapped.size());
+        istream mappedIn(&mappedBuf);
+        istream& in = mapped.data() ? mappedIn : file;
+        ofstream out(outputFile, ios::binary);
+        
+        if (!in || !out) {
+            reportError("Cannot open files!");
+            return false;
+        }
+        return decompressRange(in, out, offset, length, stats);
+    }
+    
+    // Streaming variant; reads HUF2 as well as legacy HUF1 files. Timings and
+    // counters go to stats when given (originalSize is the decoded size,
+    // compressedSize that of the input, or the bytes read from a pipe).
+    bool decompress(istream& in, ostream& out, CompressionStats* stats = nullptr) {
+        auto startTime = high_resolution_clock::now();
+        CompressionStats local = CompressionStats();
+        local.algorithm = "Huffman Coding";
+        size_t inputSize = streamRemaining(in);
+        
+        displayProgress("Reading compressed file", 10);
+        
+        // Check magic number
+        char magic[5];
+        bool magicRead = countedRead(in, magic, 4, local.counters);
+        magic[4] = '\0';
+        
+        bool ok;
+        if (magicRead && string(magic) == "HUF2") {
+            ok = decompressBlocks(in, out, local);
+        } else if (magicRead && string(magic) == "HUF1") {
+            ok = decompressLegacy(in, out, local);
+        } else {
+            reportError("Invalid file format!");
+            return false;
+        }
+        if (!ok) return false;
+        out.flush();
+        
+        displayProgress("Decompression complete", 100);
+        
+        if (stats) {
+            local.processingTime = duration_cast<duration<double>>(high_resolution_clock::now() - startTime);
+            local.originalSize = local.counters.bytesWritten;
+            local.compressedSize = inputSize ? inputSize : local.counters.bytesRead;
+            local.compressionRatio = local.originalSize ? (double)local.compressedSize / local.originalSize : 0;
+            local.spaceSavings = (1.0 - local.compressionRatio) * 100;
+            *stats = local;
+        }
+        return true;
+    }
+    
+    // Buffer-to-buffer compression for embedding. out is cleared but keeps
+    // its capacity, so a reused vector and compressor (which keeps its worker
+    // pool and shared table) make repeated calls allocation-light. Nothing is
+    // printed; progress goes to the callback and failures to lastError().
+    CompressionStats compress(const uint8_t* data, size_t size, vector<uint8_t>& out) {
+        ConsoleMute mute;
+        out.clear();
+        VectorBuf sink(out);
+        ostream os(&sink);
+        return compressStream(memoryBlocks(data, size, blockSize), os, [&](size_t done) {
+            if (progressCallback) progressCallback("Encoding blocks", (int)(100 * done / size));
+        });
+    }
+    
+    bool decompress(const uint8_t* data, size_t size, vector<uint8_t>& out, CompressionStats* stats = nullptr) {
+        ConsoleMute mute;
+        out.clear();
+        MemoryBuf source(data, size);
+        istream in(&source);
+        VectorBuf sink(out);
+        ostream os(&sink);
+        return decompress(in, os, stats);
+    }
+    
+    // Largest output of compressing size bytes with the current settings:
+    // every block at worst stored, plus the header, end marker, index and
+    // footer. Blocks are at least min(blockSize, kMinViewBlock) bytes apart
+    // from the last.
+    size_t compressBound(size_t size) const {
+        size_t blocks = size / min(blockSize, kMinViewBlock) + 1;
+        return size + 14 + 5 + 16 + blocks * (9 + 4 + 16);
+    }
+    
+    // Scatter/gather compression into a caller's buffer: the input spans are
+    // histogrammed and encoded in place, and only the finished records are
+    // copied out. Returns the compressed size, or 0 when dst is too small
+    // (capacity >= compressBound() always fits).
+    size_t compress(const vector<ByteSpan>& parts, uint8_t* dst, size_t capacity, CompressionStats* stats = nullptr) {
+        ConsoleMute mute;
+        size_t total = 0;
+        for (const ByteSpan& part : parts) total += part.size;
+        
+        FixedBuf sink(dst, capacity);
+        ostream os(&sink);
+        CompressionStats local = compressStream(gatherBlocks(parts, blockSize), os, [&](size_t done) {
+            if (progressCallback) progressCallback("Encoding blocks", (int)(100 * done / total));
+        });
+        if (!os) {
+            reportError("Output buffer too small!");
+            return 0;
+        }
+        if (stats) *stats = local;
+        return sink.written();
+    }
+    
+    // Small-message mode for RPC bodies and log lines, where a block header
+    // and a table built per call cost more than they save: a kind byte (the
+    // built-in table, or stored), the varint length, then the bytes or their
+    // code, laid out as in HUF2 records and split into four streams from
+    // kSmallSplit bytes up so that they decode in parallel. Nothing is
+    // allocated or reported and there is no checksum; the transport is
+    // expected to carry one. Returns the compressed size, or 0 when dst is
+    // too small (capacity >= compressSmallBound() always fits). Coding writes
+    // up to 8 bytes past the payload, so without that room an input is
+    // stored instead.
+    static size_t compressSmall(const uint8_t* data, size_t size, uint8_t* dst, size_t capacity) {
+        const SharedTable* tables = builtinTables();
+        // A byte's code length in each table, 21 bits apart, so a single
+        // add per byte prices all three
+        static const array<uint64_t, 256> costs = [tables] {
+            array<uint64_t, 256> packed;
+            for (int s = 0; s < 256; s++) {
+                packed[s] = tables[0].lengths[s] | (uint64_t)tables[1].lengths[s] << 21 |
+                            (uint64_t)tables[2].lengths[s] << 42;
+            }
+            return packed;
+        }();
+        
+        uint64_t bits[3] = {0};
+        for (size_t begin = 0; begin < size; begin += kSmallCostRun) {
+            uint64_t sum = 0;
+            for (size_t i = begin, end = min(size, begin + kSmallCostRun); i < end; i++) sum += costs[data[i]];
+            for (int t = 0; t < 3; t++) bits[t] += (sum >> (21 * t)) & ((1 << 21) - 1);
+        }
+        int best = (int)(min_element(bits, bits + 3) - bits);
+        bool split = size >= kSmallSplit;
+        size_t bound = (size_t)((bits[best] + 7) / 8) + (split ? 12 + 3 : 0);
+        
+        uint8_t length[10];
+        size_t header = 1 + putVarint(length, size);
+        if (bound < size && header + bound + 8 <= capacity) {
+            dst[0] = (uint8_t)(best + 1);
+            memcpy(dst + 1, length, header - 1);
+            const SharedTable& table = tables[best];
+            return header + writeStreamsFor<HuffmanDecoder::kPrimaryBits>(data, size, table.codes, table.lengths,
+                                                                          split, dst + header);
+        }
+        if (header + size > capacity) return 0;
+        dst[0] = kSmallStored;
+        memcpy(dst + 1, length, header - 1);
+        if (size) memcpy(dst + header, data, size);
+        return header + size;
+    }
+    
+    static size_t compressSmallBound(size_t size) {
+        uint8_t length[10];
+        return 1 + putVarint(length, size) + size + 7;
+    }
+    
+    // Decodes a compressSmall() message into dst and sets written; false when
+    // it is malformed or decodes to more than capacity bytes. The streams
+    // must add up to the payload, which catches most truncation.
+    static bool decompressSmall(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, size_t& written) {
+        uint64_t length;
+        size_t lengthBytes = size ? getVarint(src + 1, size - 1, length) : 0;
+        if (lengthBytes == 0 || src[0] > 3 || length > capacity) return false;
+        const uint8_t* payload = src + 1 + lengthBytes;
+        size_t payloadSize = size - 1 - lengthBytes;
+        
+        if (src[0] == kSmallStored) {
+            if (payloadSize != length) return false;
+            if (length) memcpy(dst, payload, length);
+        } else {
+            const SharedTable& table = builtinTables()[src[0] - 1];
+            bool split = length >= kSmallSplit;
+            if (length > payloadSize * 8 || !readStreams(table.decoder, payload, payloadSize, dst, length, split)) {
+                return false;
+            }
+            size_t quarter = split ? (length + 3) / 4 : length;
+            size_t expected = split ? 12 : 0;
+            for (size_t begin = 0; begin < length; begin += quarter) {
+                uint64_t bits = 0;
+                for (size_t i = begin; i < min<size_t>(length, begin + quarter); i++) bits += table.lengths[dst[i]];
+                expected += (size_t)((bits + 7) / 8);
+            }
+            if (expected != payloadSize) return false;
+        }
+        written = (size_t)length;
+        return true;
+    }
+    
+    void setProgressCallback(ProgressCallback callback) {
+        progressCallback = move(callback);
+    }
+    
+    // Message of the last error reported on the calling thread
+    const string& lastError() const {
+        return lastErrorSlot();
+    }
+    
+    void setThreads(unsigned count) {
+        threadCount = max(count, 1u);
+    }
+    
+    // Caps code lengths (8..15 bits). The default matches the decoder's
+    // primary table, so every symbol resolves in a single probe.
+    void setMaxCodeLength(int bits) {
+        maxCodeLength = min(max(bits, 8), kMaxCodeLength);
+    }
+    
+    // 0 is plain Huffman; 1-9 add the LZ stage with increasingly thorough
+    // match finding
+    void setLevel(int level) {
+        compressionLevel = min(max(level, 0), kMaxLevel);
+    }
+    
+    void setEntropyCoder(EntropyCoder coder) {
+        entropyCoder = coder;
+    }
+    
+    // Builds code lengths from the byte histogram of the samples, with every
+    // byte value kept codable, and saves them as a table file:
+    // "HUFT", u8 version, u32 id, packed lengths
+    bool trainTable(const vector<string>& samples, const string& tableFile) {
+        uint64_t freq[256] = {0};
+        for (const string& sample : samples) {
+            MappedFile mapped;
+            if (mapped.open(sample)) {
+                countBytes(mapped.data(), mapped.size(), freq);
+                continue;
+            }
+            ifstream in(sample, ios::binary);
+            if (!in) {
+                reportError("Cannot open " + sample + "!");
+                return false;
+            }
+            vector<uint8_t> buffer(kStreamWindow);
+            while (in.read(reinterpret_cast<char*>(buffer.data()), buffer.size()) || in.gcount() > 0) {
+                countBytes(buffer.data(), (size_t)in.gcount(), freq);
+            }
+        }
+        for (int s = 0; s < 256; s++) freq[s]++;
+        
+        uint8_t len[256];
+        buildCodeLengths(freq, len);
+        uint32_t id = tableId(len);
+        vector<uint8_t> table = {'H', 'U', 'F', 'T', kTableVersion};
+        putU32(table, id);
+        packLengths(len, table);
+        
+        ofstream out(tableFile, ios::binary);
+        out.write(reinterpret_cast<const char*>(table.data()), table.size());
+        if (!out.flush()) {
+            reportError("Cannot write " + tableFile + "!");
+            return false;
+        }
+        if (!quiet) {
+            char name[16];
+            snprintf(name, sizeof(name), "%08x", id);
+            cout << GREEN << "✓ Trained table " << name << " on " << samples.size() << " files" << RESET << endl;
+        }
+        return true;
+    }
+    
+    // Compresses with the table from now on, and decodes files that name it
+    bool loadTable(const string& tableFile) {
+        ifstream in(tableFile, ios::binary);
+        uint8_t header[9];
+        unique_ptr<SharedTable> table(new SharedTable());
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        bool ok = in && memcmp(header, "HUFT", 4) == 0 && header[4] == kTableVersion &&
+                  readPackedLengths(in, table->lengths) != 0 && count(table->lengths, table->lengths + 256, 0) == 0;
         
+        uint64_t codes[256];
+        ok = ok && tableId(table->lengths) == getU32(header + 5) && assignCanonicalCodes(table->lengths, codes) &&
+             table->decoder.build(codes, table->lengths);
+        if (!ok) {
+            reportError("Invalid table file!");
+            return false;
+        }
+        table->id = getU32(header + 5);
+        for (int s = 0; s < 256; s++) table->codes[s] = (uint32_t)codes[s];
+        sharedTable = move(table);
         return true;
     }
     
+    // Huffman blocks of kMinSplitBlock bytes or more are coded as four
+    // streams by default, which lets the decoder overlap their lookups
+    void setSplitStreams(bool split) {
+        splitStreams = split;
+    }
+    
+    // Codes each block from a histogram of 1 in rate runs of it instead of
+    // every byte; a block whose payload comes out more than maxLoss larger
+    // than the optimal code for its exact counts, taken while coding, is
+    // recoded from those counts. 0 or 1 turns it off.
+    void setSampling(unsigned rate, double maxLoss = kDefaultSampleLoss) {
+        sampleRate = rate > 1 ? rate : 0;
+        sampleLoss = max(maxLoss, 0.0);
+    }
+    
+    void setDedup(bool enabled) {
+        dedup = enabled;
+    }
+    
+    void setBlockSize(size_t bytes) {
+        blockSize = min(max(bytes, (size_t)4096), kMaxBlockSize);
+    }
+    
     void displayStats(const CompressionStats& stats) {
         cout << "\n" << BOLD << GREEN << "🎉 COMPRESSION SUCCESSFUL!" << RESET << endl;
         cout << "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━" << endl;
@@ -439,25 +4442,133 @@ public:
         cout << "   Performance Rating: " << ratingColor << BOLD << rating << RESET << endl;
     }
     
-    void batchCompress(const vector<string>& files, const string& outputDir) {
-        displayHeader("BATCH COMPRESSION MODE");
+    void displayAnalysis(const string& filename, const FileAnalysis& analysis) {
+        cout << CYAN << "\n📊 File Analysis Report for: " << BOLD << filename << RESET << endl;
+        cout << "━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━━" << endl;
+        
+        size_t totalChars = analysis.size;
+        double savings = totalChars ? 100.0 * ((double)totalChars - (double)analysis.predictedSize) / totalChars : 0;
+        cout << "📁 File Size: " << formatFileSize(totalChars) << " (" << totalChars << " bytes)" << endl;
+        cout << "🔤 Unique Characters: " << analysis.uniqueBytes << endl;
+        cout << "📈 Entropy: " << fixed << setprecision(3) << analysis.entropy << " bits" << endl;
+        cout << "🔗 Order-1 Entropy: " << analysis.conditionalEntropy << " bits (given the previous byte)" << endl;
+        cout << "🔮 Predicted Size: " << formatFileSize(analysis.predictedSize) << " (" << setprecision(1)
+             << savings << "% savings at level 0)" << endl;
+        cout << "⏱️  Analysis Time: " << setprecision(3) << analysis.processingTime.count() << " seconds" << endl;
+        
+        // When per-byte codes gain nothing but the previous byte still predicts
+        // the next, there is structure for the LZ levels to find
+        string verdict = savings >= 2 ? "worth compressing"
+                       : analysis.entropy - analysis.conditionalEntropy >= 0.5 ? "try an LZ level (-l)"
+                       : "store as is";
+        cout << "💡 Verdict: " << BOLD << verdict << RESET << endl;
+        
+        // One bar per block, averaged down to at most 8 rows of 64; taller
+        // bars are closer to 8 bits per byte
+        static const char* kBars[8] = {"▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+        size_t blocks = analysis.blockEntropy.size();
+        if (blocks > 1) {
+            size_t cells = min(blocks, (size_t)512);
+            cout << "\n🗺️  Block Entropy Map (" << formatFileSize(totalChars / cells) << " per bar, 0-8 bits):" << endl;
+            for (size_t c = 0; c < cells; c++) {
+                size_t from = c * blocks / cells, to = (c + 1) * blocks / cells;
+                double sum = 0;
+                for (size_t b = from; b < to; b++) sum += analysis.blockEntropy[b];
+                if (c % 64 == 0) cout << "   ";
+                cout << kBars[min(7, (int)(sum / (to - from)))];
+                if (c % 64 == 63 || c + 1 == cells) cout << endl;
+            }
+        }
+        
+        vector<pair<char, uint64_t>> sortedFreq;
+        for (int s = 0; s < 256; s++) {
+            if (analysis.frequencies[s]) sortedFreq.push_back({(char)s, analysis.frequencies[s]});
+        }
+        
+        // Show top 10 most frequent characters
+        sort(sortedFreq.begin(), sortedFreq.end(), [](const auto& a, const auto& b) {
+            return a.second > b.second;
+        });
+        
+        cout << "\n🏆 Top 10 Most Frequent Characters:" << endl;
+        for (int i = 0; i < min(10, (int)sortedFreq.size()); i++) {
+            char c = sortedFreq[i].first;
+            string charDisplay = (c == ' ') ? "SPACE" : 
+                                (c == '\n') ? "NEWLINE" : 
+                                (c == '\t') ? "TAB" : string(1, c);
+            cout << "   " << i+1 << ". '" << charDisplay << "' : " << sortedFreq[i].second 
+                 << " (" << fixed << setprecision(2) << (100.0 * sortedFreq[i].second / totalChars) << "%)" << endl;
+        }
+    }
+    
+    // Every file is a job on the work-stealing pool; the blocks of a large
+    // file are stolen by idle workers, so a big file late in the list does
+    // not serialize the tail of the batch. Files that could not be compressed
+    // come back with empty stats.
+    vector<CompressionStats> batchCompress(const vector<string>& files, const string& outputDir) {
+        if (!quiet) displayHeader("BATCH COMPRESSION MODE");
         
         if (!fileExists(outputDir)) {
             createDirectory(outputDir);
         }
         
-        cout << "🚀 Processing " << files.size() << " files..." << endl;
+        WorkStealingPool& workers = pool();
+        if (!quiet) cout << "🚀 Processing " << files.size() << " files on " << workers.size() << " threads..." << endl;
+        
+        auto startTime = high_resolution_clock::now();
+        
+        // One slot per file, written only by that file's job
+        vector<CompressionStats> allStats(files.size());
+        vector<string> outputFiles = batchOutputPaths(files, outputDir);
+        
+        size_t totalBytes = 0;
+        for (const auto& file : files) totalBytes += getFileSize(file);
+        
+        atomic<size_t> bytesDone{0};
+        atomic<size_t> filesDone{0};
+        mutex barMutex;
+        int lastPercent = -1;
         
-        vector<CompressionStats> allStats;
+        // Single combined progress line, redrawn only when the percentage moves
+        auto updateProgress = [&]() {
+            int percentage = totalBytes ? (int)(100 * bytesDone / totalBytes)
+                                        : (int)(100 * filesDone / max(files.size(), (size_t)1));
+            percentage = min(percentage, 99);
+            lock_guard<mutex> lock(barMutex);
+            if (percentage > lastPercent) {
+                lastPercent = percentage;
+                displayProgress("Batch compression", percentage);
+            }
+        };
         
+        vector<future<void>> jobs;
         for (size_t i = 0; i < files.size(); i++) {
-            cout << "\n" << BOLD << "[" << (i+1) << "/" << files.size() << "] " << files[i] << RESET << endl;
-            
-            string outputFile = outputDir + "/" + getFileNameWithoutExtension(files[i]) + ".huf";
-            CompressionStats stats = compress(files[i], outputFile);
-            allStats.push_back(stats);
-            
-            cout << "   " << GREEN << "✓ Saved as: " << outputFile << RESET << endl;
+            jobs.push_back(workers.submit([&, i] {
+                size_t reported = 0;
+                allStats[i] = compressFile(files[i], outputFiles[i], [&](size_t done) {
+                    bytesDone += done - reported;
+                    reported = done;
+                    updateProgress();
+                }, getFileSize(files[i]) >= kPipelineMinInput);
+                filesDone++;
+                updateProgress();
+            }, true));
+        }
+        for (auto& job : jobs) job.get();
+        
+        displayProgress("Batch compression", 100);
+        
+        auto endTime = high_resolution_clock::now();
+        double wallTime = duration_cast<duration<double>>(endTime - startTime).count();
+        if (quiet) return allStats;
+        
+        for (size_t i = 0; i < files.size(); i++) {
+            cout << BOLD << "[" << (i+1) << "/" << files.size() << "] " << files[i] << RESET;
+            if (allStats[i].error.empty()) {
+                cout << "   " << GREEN << "✓ Saved as: " << outputFiles[i] << RESET << endl;
+            } else {
+                cout << "   " << RED << "✗ " << allStats[i].error << RESET << endl;
+            }
         }
         
         // Summary statistics
@@ -473,7 +4584,7 @@ public:
             totalTime += stats.processingTime.count();
         }
         
-        double overallRatio = (double)totalCompressed / totalOriginal;
+        double overallRatio = totalOriginal ? (double)totalCompressed / totalOriginal : 0;
         double overallSavings = (1.0 - overallRatio) * 100;
         
         cout << "   Total Original Size: " << YELLOW << formatFileSize(totalOriginal) << RESET << endl;
@@ -481,11 +4592,391 @@ public:
         cout << "   Overall Compression Ratio: " << MAGENTA << fixed << setprecision(2) << overallRatio << ":1" << RESET << endl;
         cout << "   Overall Space Savings: " << GREEN << fixed << setprecision(1) << overallSavings << "%" << RESET << endl;
         cout << "   Total Processing Time: " << CYAN << fixed << setprecision(2) << totalTime << " seconds" << RESET << endl;
+        cout << "   Wall Clock Time: " << CYAN << fixed << setprecision(2) << wallTime << " seconds" << RESET << endl;
+        
+        return allStats;
+    }
+    
+    // Writes the files into one HUFA archive: a HUF2 stream of their data,
+    // then a directory of members, each a list of extents of that stream.
+    // With dedup set the inputs are cut into content-defined chunks and a
+    // chunk seen before, in any input, is not stored or encoded again; its
+    // extent points at the first copy. Returns empty stats on failure.
+    CompressionStats compressArchive(const vector<string>& files, const string& archiveFile) {
+        auto startTime = high_resolution_clock::now();
+        if (!quiet) displayHeader(dedup ? "DEDUPLICATING ARCHIVE" : "ARCHIVE MODE");
+        unordered_set<string> names;
+        for (const string& file : files) {
+            if (!names.insert(file).second) {
+                reportError("Duplicate archive member " + file);
+                return CompressionStats();
+            }
+        }
+        
+        // Every input stays loaded to the end, as later chunks are compared
+        // against the bytes of earlier ones
+        vector<unique_ptr<MappedFile>> mapped;
+        vector<vector<uint8_t>> loaded;
+        vector<ByteSpan> inputs;
+        size_t totalInput = 0;
+        PipelineCounters counters;
+        for (const string& file : files) {
+            auto mapping = make_unique<MappedFile>();
+            if (mapping->open(file)) {
+                inputs.push_back({mapping->data(), mapping->size()});
+                mapped.push_back(move(mapping));
+                FC_STAT(counters.bytesRead += inputs.back().size);
+            } else {
+                ifstream in(file, ios::binary);
+                if (!in) {
+                    reportError("Cannot open file " + file);
+                    return CompressionStats();
+                }
+                vector<uint8_t> bytes;
+                countedResize(bytes, streamRemaining(in), counters);
+                countedRead(in, bytes.data(), bytes.size(), counters);
+                inputs.push_back({bytes.data(), bytes.size()});
+                loaded.push_back(move(bytes));
+            }
+            totalInput += inputs.back().size;
+        }
+        
+        ofstream out(archiveFile, ios::binary);
+        if (!out) {
+            reportError("Cannot open files!");
+            return CompressionStats();
+        }
+        const uint8_t archiveHeader[kArchiveHeader] = {'H', 'U', 'F', 'A', kArchiveVersion, 0};
+        countedWrite(out, archiveHeader, sizeof(archiveHeader), counters);
+        
+        vector<ArchiveMember> members(files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            members[i].name = files[i];
+            members[i].size = inputs[i].size;
+        }
+        
+        // Stored chunks by CRC and length, pointing at their first copy
+        struct StoredChunk {
+            const uint8_t* data;
+            uint64_t offset;
+        };
+        unordered_multimap<uint64_t, StoredChunk> stored;
+        
+        // Cut points and chunk CRCs depend on nothing but the input, so the
+        // workers find them for all inputs ahead of the matching below
+        struct Chunk {
+            uint32_t length;
+            uint32_t crc;
+        };
+        WorkStealingPool& workers = pool();
+        vector<future<vector<Chunk>>> cuts;
+        for (const ByteSpan& input : inputs) {
+            cuts.push_back(workers.submit([this, input] {
+                vector<Chunk> chunks;
+                for (size_t pos = 0; pos < input.size;) {
+                    size_t length = dedup ? nextChunk(input.data + pos, input.size - pos, kMinChunk, kMaxChunk, kChunkBits)
+                                          : min(input.size - pos, blockSize);
+                    chunks.push_back({(uint32_t)length, Crc32c::update(0, input.data + pos, length)});
+                    pos += length;
+                }
+                return chunks;
+            }));
+        }
+        
+        vector<Chunk> chunks;
+        size_t file = 0, chunkIndex = 0, pos = 0;
+        size_t consumed = 0;
+        uint64_t queued = 0;  // bytes in the blocks handed to the encoder
+        ByteSpan pending = {nullptr, 0};  // rest of a chunk that did not fit the last block
+        
+        auto addExtent = [](ArchiveMember& member, uint64_t offset, size_t length) {
+            ArchiveExtent* last = member.extents.empty() ? nullptr : &member.extents.back();
+            if (last && last->offset + last->length == offset && last->length + length <= UINT32_MAX) {
+                last->length += (uint32_t)length;
+            } else {
+                member.extents.push_back({offset, (uint32_t)length});
+            }
+        };
+        
+        // Matches and packs chunks into blocks of unique bytes on the calling
+        // thread while the workers encode the blocks before
+        BlockSource next = [&](InputBlock& block) {
+            block.owned.clear();
+            countedReserve(block.owned, blockSize, block.counters);
+            while (block.owned.size() < blockSize) {
+                if (pending.size) {
+                    size_t n = min(pending.size, blockSize - block.owned.size());
+                    block.owned.insert(block.owned.end(), pending.data, pending.data + n);
+                    pending = {pending.data + n, pending.size - n};
+                    continue;
+                }
+                if (chunkIndex == chunks.size()) {
+                    if (file == inputs.size()) break;
+                    chunks = workers.await(cuts[file++]);
+                    chunkIndex = 0;
+                    pos = 0;
+                    continue;
+                }
+                
+                ArchiveMember& member = members[file - 1];
+                const uint8_t* chunk = inputs[file - 1].data + pos;
+                size_t length = chunks[chunkIndex].length;
+                uint32_t crc = chunks[chunkIndex++].crc;
+                member.crc = Crc32c::combine(member.crc, crc, length);
+                pos += length;
+                consumed += length;
+                FC_STAT(counters.chunks += dedup ? 1 : 0);
+                
+                if (dedup) {
+                    uint64_t key = (uint64_t)crc << 32 | length;
+                    auto range = stored.equal_range(key);
+                    auto match = find_if(range.first, range.second, [&](const auto& entry) {
+                        return memcmp(entry.second.data, chunk, length) == 0;
+                    });
+                    if (match != range.second) {
+                        addExtent(member, match->second.offset, length);
+                        FC_STAT(counters.duplicateChunks++);
+                        FC_STAT(counters.duplicateBytes += length);
+                        continue;
+                    }
+                    stored.insert({key, {chunk, queued + block.owned.size()}});
+                }
+                addExtent(member, queued + block.owned.size(), length);
+                pending = {chunk, length};
+            }
+            if (block.owned.empty()) return false;
+            block.data = block.owned.data();
+            block.size = block.owned.size();
+            queued += block.size;
+            return true;
+        };
+        
+        CompressionStats stats = compressStream(next, out, [&](size_t) {
+            if (totalInput) displayProgress("Encoding chunks", (int)(99 * consumed / totalInput));
+        }, totalInput >= kPipelineMinInput);
+        
+        // Directory and footer after the data stream
+        uint64_t directoryOffset = kArchiveHeader + stats.compressedSize;
+        vector<uint8_t> directory;
+        for (const ArchiveMember& member : members) {
+            putU32(directory, (uint32_t)member.name.size());
+            directory.insert(directory.end(), member.name.begin(), member.name.end());
+            putU64(directory, member.size);
+            putU32(directory, member.crc);
+            putU32(directory, (uint32_t)member.extents.size());
+            for (const ArchiveExtent& extent : member.extents) {
+                putU64(directory, extent.offset);
+                putU32(directory, extent.length);
+            }
+        }
+        putU32(directory, Crc32c::update(0, directory.data(), directory.size()));
+        putU32(directory, (uint32_t)members.size());
+        putU64(directory, directoryOffset);
+        directory.insert(directory.end(), {'H', 'U', 'F', 'A'});
+        countedWrite(out, directory.data(), directory.size(), counters);
+        out.close();
+        if (!out) {
+            reportError("Cannot write " + archiveFile);
+            return CompressionStats();
+        }
+        displayProgress("Archive complete", 100);
+        
+        stats.counters += counters;
+        stats.originalSize = totalInput;
+        stats.compressedSize = (size_t)directoryOffset + directory.size();
+        stats.processingTime = duration_cast<duration<double>>(high_resolution_clock::now() - startTime);
+        stats.compressionRatio = totalInput ? (double)stats.compressedSize / totalInput : 0;
+        stats.spaceSavings = (1.0 - stats.compressionRatio) * 100;
+        
+        if (!quiet) {
+            displayStats(stats);
+            cout << "   Members: " << BLUE << members.size() << RESET << endl;
+            if (dedup) {
+                cout << "   Duplicate Data: " << GREEN << formatFileSize(stats.counters.duplicateBytes) << RESET << " in "
+                     << stats.counters.duplicateChunks << " of " << stats.counters.chunks << " chunks" << endl;
+            }
+        }
+        return stats;
+    }
+    
+    // Extracts the named members of a HUFA archive, or all of them, under
+    // outputDir and checks each against its CRC. Every member is a job on
+    // the work-stealing pool; only the blocks the chosen members cover are
+    // decoded, each once, so a selection costs what it holds rather than
+    // what the archive does.
+    bool extractArchive(const string& archiveFile, const string& outputDir, const vector<string>& names = {},
+                        CompressionStats* stats = nullptr) {
+        auto startTime = high_resolution_clock::now();
+        MappedFile mapped;
+        vector<uint8_t> loaded;
+        ByteSpan archive, store;
+        vector<ArchiveMember> members;
+        if (!openArchive(archiveFile, mapped, loaded, archive, store, members)) return false;
+        
+        CompressionStats local = CompressionStats();
+        local.algorithm = "Huffman Coding";
+        MemoryBuf storeBuf(store.data, store.size);
+        istream in(&storeBuf);
+        uint8_t flags;
+        size_t fileBlockSize;
+        vector<BlockIndexEntry> index;
+        if (!readBlockIndex(in, flags, fileBlockSize, index, local.counters)) {
+            reportError("Missing or corrupted block index!");
+            return false;
+        }
+        in.seekg(10);
+        if (!checkTableReference(in, flags, local.counters)) return false;
+        uint64_t total = index.empty() ? 0 : index.back().rawOffset + index.back().rawSize;
+        
+        vector<size_t> chosen;
+        if (names.empty()) {
+            chosen.resize(members.size());
+            iota(chosen.begin(), chosen.end(), 0);
+        }
+        for (const string& name : names) {
+            auto member = find_if(members.begin(), members.end(), [&](const ArchiveMember& m) { return m.name == name; });
+            if (member == members.end()) {
+                reportError("No member " + name + " in " + archiveFile);
+                return false;
+            }
+            chosen.push_back((size_t)(member - members.begin()));
+        }
+        
+        // Everything that can fail before writing is checked up front
+        vector<string> outputs(chosen.size());
+        vector<vector<BlockSlice>> slices(chosen.size());
+        unordered_set<string> taken;
+        for (size_t i = 0; i < chosen.size(); i++) {
+            const ArchiveMember& member = members[chosen[i]];
+            uint64_t length = 0;
+            for (const ArchiveExtent& extent : member.extents) {
+                if (extent.offset > total || extent.length > total - extent.offset) break;
+                appendSlices(index, extent.offset, extent.offset + extent.length, slices[i]);
+                length += extent.length;
+            }
+            string path = archiveMemberPath(member.name);
+            if (path.empty() || length != member.size) {
+                reportError("Archive directory does not match the data!");
+                return false;
+            }
+            if (!taken.insert(path).second) {
+                reportError("Two members extract to " + path);
+                return false;
+            }
+            outputs[i] = outputDir + "/" + path;
+        }
+        if (!fileExists(outputDir)) createDirectory(outputDir);
+        for (const string& output : outputs) createParentDirectories(output);
+        
+        // Small members share blocks, and with dedup so do repeated chunks
+        BlockCache cache(index.size());
+        for (const vector<BlockSlice>& memberSlices : slices) {
+            for (size_t k = 0; k < memberSlices.size(); k++) {
+                if (!k || memberSlices[k].block != memberSlices[k - 1].block) cache.expect(memberSlices[k].block);
+            }
+        }
+        
+        WorkStealingPool& workers = pool();
+        vector<CompressionStats> memberStats(chosen.size(), CompressionStats());
+        vector<string> errors(chosen.size());
+        atomic<size_t> membersDone{0};
+        vector<future<void>> jobs;
+        for (size_t i = 0; i < chosen.size(); i++) {
+            jobs.push_back(workers.submit([&, i] {
+                ConsoleMute mute;
+                const ArchiveMember& member = members[chosen[i]];
+                MemoryBuf memberBuf(store.data, store.size);
+                istream memberIn(&memberBuf);
+                ofstream out(outputs[i], ios::binary);
+                uint32_t crc = 0;
+                if (!out) {
+                    errors[i] = "Cannot open " + outputs[i];
+                } else if (!writeSlices(memberIn, fileBlockSize, index, slices[i], out, memberStats[i], &crc,
+                                        &cache)) {
+                    errors[i] = lastError();
+                } else if (out.close(), !out) {
+                    errors[i] = "Cannot write " + outputs[i];
+                } else if (crc != member.crc) {
+                    errors[i] = "Checksum mismatch in " + member.name;
+                }
+                displayProgress("Extracting members", (int)(100 * ++membersDone / chosen.size()));
+            }, true));
+        }
+        for (auto& job : jobs) job.get();
+        
+        for (size_t i = 0; i < chosen.size(); i++) {
+            if (!errors[i].empty()) {
+                reportError(errors[i]);
+                return false;
+            }
+            local.stages += memberStats[i].stages;
+            local.counters += memberStats[i].counters;
+        }
+        
+        if (!quiet) {
+            double seconds = duration_cast<duration<double>>(high_resolution_clock::now() - startTime).count();
+            cout << GREEN << "\n✓ Extracted " << chosen.size() << " members to " << outputDir << RESET << endl;
+            cout << "⏱️  Processing time: " << fixed << setprecision(3) << seconds << " seconds" << endl;
+        }
+        if (stats) {
+            local.processingTime = duration_cast<duration<double>>(high_resolution_clock::now() - startTime);
+            local.originalSize = local.counters.bytesWritten;
+            local.compressedSize = archive.size;
+            local.compressionRatio = local.originalSize ? (double)local.compressedSize / local.originalSize : 0;
+            local.spaceSavings = (1.0 - local.compressionRatio) * 100;
+            *stats = local;
+        }
+        return true;
+    }
+    
+    // Reads only an archive's directory; no data is decoded
+    bool listArchive(const string& archiveFile, vector<ArchiveMember>& members) {
+        MappedFile mapped;
+        vector<uint8_t> loaded;
+        ByteSpan archive, store;
+        return openArchive(archiveFile, mapped, loaded, archive, store, members);
     }
     
     void toggleProgress(bool show) {
         showProgress = show;
     }
+    
+    // Quiet runs print errors only: no progress bars, banners or summaries
+    void setQuiet(bool q) {
+        quiet = q;
+        if (q) showProgress = false;
+    }
+    
+    // Analyzes a file without compressing it; false when it cannot be read
+    bool analyze(const string& filename, FileAnalysis& result) {
+        MappedFile mapped;
+        ifstream file;
+        if (!mapped.open(filename)) file.open(filename, ios::binary);
+        if (!mapped.data() && !file) {
+            reportError("Cannot open file " + filename);
+            return false;
+        }
+        
+        if (mapped.data()) {
+            analyzeBlocks(mappedBlocks(mapped, blockSize), mapped.size(), result);
+        } else {
+            size_t total = streamRemaining(file);
+            analyzeBlocks(prefetchBlocks(streamBlocks(file, blockSize), kReadAhead), total, result);
+        }
+        return true;
+    }
+    
+    FileAnalysis analyze(const uint8_t* data, size_t size) {
+        ConsoleMute mute;
+        FileAnalysis result;
+        analyzeBlocks(memoryBlocks(data, size, blockSize), size, result);
+        return result;
+    }
+    
+    void analyze(const string& filename) {
+        FileAnalysis analysis;
+        if (analyze(filename, analysis)) displayAnalysis(filename, analysis);
+    }
 };
 
 void displayMenu() {
@@ -515,7 +5006,656 @@ void displayAbout() {
     cout << "👨‍💻 Created by: [ROHIT SUKUL] - Demonstrating advanced C++ programming skills" << endl;
 }
 
-int main() {
+void displayUsage() {
+    cerr << "Usage: file_compressor                 (interactive menu)\n"
+         << "       file_compressor compress   <file> [-o out]\n"
+         << "       file_compressor decompress <file> [-o out]\n"
+         << "       file_compressor extract    <file> --offset <bytes> [--length <bytes>] [-o out]\n"
+         << "       file_compressor analyze    <file>\n"
+         << "       file_compressor batch      <files...> [-o dir]\n"
+         << "       file_compressor batch      <files...> --archive [--dedup] [-o archive]\n"
+         << "       file_compressor unpack     <archive> [members...] [-o dir]\n"
+         << "       file_compressor list       <archive>\n"
+         << "       file_compressor bench      [files...] [-n trials] [--warmup runs] [--small]\n"
+         << "       file_compressor train      <samples...> [-o table]\n"
+         << "Options: -j <threads>  -l <level 0-9>  --block-size <bytes[K|M]>  --coder auto|huffman|ans\n"
+         << "         --streams 1|4  --table <file>  --sample <1-in-N> [--sample-loss <percent>]\n"
+         << "         --max-code-length <8-15>  --quiet  --format text|json|csv" << endl;
+}
+
+struct CommandLine {
+    string command;
+    vector<string> inputs;
+    string output;
+    unsigned threads = 0;
+    size_t blockSize = 0;
+    int iterations = 3;
+    int warmup = 1;
+    int level = 0;
+    EntropyCoder coder = EntropyCoder::Auto;
+    int streams = 4;
+    int maxCodeLength = 0;
+    unsigned sampleRate = 0;
+    double sampleLoss = -1;
+    size_t offset = 0;
+    size_t length = SIZE_MAX;
+    string table;
+    bool quiet = false;
+    bool archive = false;
+    bool dedup = false;
+    bool small = false;
+    string format = "text";
+};
+
+// One line of machine-readable output
+struct StatsRow {
+    string command;
+    string input;
+    string output;
+    CompressionStats stats;
+};
+
+bool parseSize(const string& text, size_t& value) {
+    char* end;
+    double n = strtod(text.c_str(), &end);
+    string suffix = end;
+    if (end == text.c_str() || n < 0) return false;
+    if (suffix == "K" || suffix == "k") n *= 1 << 10;
+    else if (suffix == "M" || suffix == "m") n *= 1 << 20;
+    else if (!suffix.empty()) return false;
+    value = (size_t)n;
+    return true;
+}
+
+bool parseCommandLine(int argc, char** argv, CommandLine& cmd) {
+    cmd.command = argv[1];
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-o" && hasValue) {
+            cmd.output = argv[++i];
+        } else if (arg == "-j" && hasValue) {
+            cmd.threads = (unsigned)atoi(argv[++i]);
+            if (cmd.threads == 0) return false;
+        } else if (arg == "-n" && hasValue) {
+            cmd.iterations = atoi(argv[++i]);
+            if (cmd.iterations <= 0) return false;
+        } else if ((arg == "-l" || arg == "--level") && hasValue) {
+            cmd.level = atoi(argv[++i]);
+            if (cmd.level < 0 || cmd.level > 9) return false;
+        } else if (arg == "--warmup" && hasValue) {
+            cmd.warmup = atoi(argv[++i]);
+            if (cmd.warmup < 0) return false;
+        } else if (arg == "--block-size" && hasValue) {
+            if (!parseSize(argv[++i], cmd.blockSize)) return false;
+        } else if (arg == "--table" && hasValue) {
+            cmd.table = argv[++i];
+        } else if (arg == "--offset" && hasValue) {
+            if (!parseSize(argv[++i], cmd.offset)) return false;
+        } else if (arg == "--length" && hasValue) {
+            if (!parseSize(argv[++i], cmd.length)) return false;
+        } else if (arg == "--coder" && hasValue) {
+            string coder = argv[++i];
+            if (coder == "auto") cmd.coder = EntropyCoder::Auto;
+            else if (coder == "huffman") cmd.coder = EntropyCoder::Huffman;
+            else if (coder == "ans") cmd.coder = EntropyCoder::Ans;
+            else return false;
+        } else if (arg == "--streams" && hasValue) {
+            cmd.streams = atoi(argv[++i]);
+            if (cmd.streams != 1 && cmd.streams != 4) return false;
+        } else if (arg == "--max-code-length" && hasValue) {
+            cmd.maxCodeLength = atoi(argv[++i]);
+            if (cmd.maxCodeLength < 8 || cmd.maxCodeLength > 15) return false;
+        } else if (arg == "--sample" && hasValue) {
+            int rate = atoi(argv[++i]);
+            if (rate < 1) return false;
+            cmd.sampleRate = (unsigned)rate;
+        } else if (arg == "--sample-loss" && hasValue) {
+            cmd.sampleLoss = atof(argv[++i]) / 100;
+            if (cmd.sampleLoss < 0) return false;
+        } else if (arg == "--format" && hasValue) {
+            cmd.format = argv[++i];
+            if (cmd.format != "text" && cmd.format != "json" && cmd.format != "csv") return false;
+        } else if (arg == "--archive") {
+            cmd.archive = true;
+        } else if (arg == "--dedup") {
+            cmd.dedup = true;
+        } else if (arg == "--small") {
+            cmd.small = true;
+        } else if (arg == "--quiet" || arg == "-q") {
+            cmd.quiet = true;
+        } else if (!arg.empty() && arg[0] == '-') {
+            return false;
+        } else {
+            cmd.inputs.push_back(arg);
+        }
+    }
+    
+    if (cmd.inputs.empty()) return cmd.command == "bench";
+    return cmd.command == "batch" || cmd.command == "bench" || cmd.command == "train" || cmd.command == "unpack" ||
+           cmd.inputs.size() == 1;
+}
+
+string jsonString(const string& text) {
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+// RFC 4180: a field holding a comma, quote or line break is quoted, with
+// quotes doubled
+string csvField(const string& value) {
+    if (value.find_first_of(",\"\r\n") == string::npos) return value;
+    string quoted = "\"";
+    for (char c : value) {
+        if (c == '"') quoted += '"';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Throughput is measured on the uncompressed side, in MB/s. A failed row
+// carries only its error: JSON drops the measurements, CSV leaves them empty
+void printStatsRows(const vector<StatsRow>& rows, const string& format) {
+    ostringstream out;
+    out << fixed << setprecision(6);
+    size_t measurements = 7;
+    if (format == "csv") {
+        out << "command,input,output,original_size,compressed_size,ratio,space_savings,unique_chars,seconds,throughput_mbps";
+        StageTimes().forEach([&](const char* name, uint64_t) { out << "," << name << "_ns"; measurements++; });
+        PipelineCounters().forEach([&](const char* name, uint64_t) { out << "," << name; measurements++; });
+        out << ",error\n";
+    } else {
+        out << "[";
+    }
+    
+    for (size_t i = 0; i < rows.size(); i++) {
+        const StatsRow& row = rows[i];
+        const CompressionStats& stats = row.stats;
+        double seconds = stats.processingTime.count();
+        double throughput = seconds > 0 ? stats.originalSize / seconds / 1e6 : 0;
+        
+        if (format == "csv" && !stats.error.empty()) {
+            out << csvField(row.command) << "," << csvField(row.input) << "," << csvField(row.output)
+                << string(measurements, ',') << "," << csvField(stats.error) << "\n";
+        } else if (format == "csv") {
+            out << csvField(row.command) << "," << csvField(row.input) << "," << csvField(row.output) << ","
+                << stats.originalSize << "," << stats.compressedSize << "," << stats.compressionRatio << ","
+                << stats.spaceSavings << "," << stats.uniqueChars << "," << seconds << "," << throughput;
+            auto field = [&](const char*, uint64_t value) { out << "," << value; };
+            stats.stages.forEach(field);
+            stats.counters.forEach(field);
+            out << ",\n";
+        } else if (!stats.error.empty()) {
+            out << (i ? "," : "") << "\n  {\"command\": " << jsonString(row.command)
+                << ", \"input\": " << jsonString(row.input) << ", \"output\": " << jsonString(row.output)
+                << ", \"error\": " << jsonString(stats.error) << "}";
+        } else {
+            out << (i ? "," : "") << "\n  {\"command\": " << jsonString(row.command)
+                << ", \"input\": " << jsonString(row.input) << ", \"output\": " << jsonString(row.output)
+                << ", \"original_size\": " << stats.originalSize << ", \"compressed_size\": " << stats.compressedSize
+                << ", \"ratio\": " << stats.compressionRatio << ", \"space_savings\": " << stats.spaceSavings
+                << ", \"unique_chars\": " << stats.uniqueChars << ", \"seconds\": " << seconds
+                << ", \"throughput_mbps\": " << throughput;
+            const char* separator = ", \"stages_ns\": {";
+            auto field = [&](const char* name, uint64_t value) {
+                out << separator << "\"" << name << "\": " << value;
+                separator = ", ";
+            };
+            stats.stages.forEach(field);
+            separator = "}, \"counters\": {";
+            stats.counters.forEach(field);
+            out << "}}";
+        }
+    }
+    if (format != "csv") out << "\n]\n";
+    cout << out.str() << flush;
+}
+
+// Block entropies go in one list field: a JSON array, or space-separated in CSV
+void printAnalysis(const string& input, const FileAnalysis& analysis, const string& format) {
+    ostringstream out;
+    out << fixed << setprecision(6);
+    double seconds = analysis.processingTime.count();
+    double throughput = seconds > 0 ? analysis.size / seconds / 1e6 : 0;
+    const char* separator = "";
+    if (format == "csv") {
+        out << "input,size,unique_bytes,entropy,conditional_entropy,predicted_size,block_size,seconds,throughput_mbps,block_entropy\n"
+            << csvField(input) << "," << analysis.size << "," << analysis.uniqueBytes << "," << analysis.entropy << ","
+            << analysis.conditionalEntropy << "," << analysis.predictedSize << "," << analysis.blockSize << ","
+            << seconds << "," << throughput << ",";
+        for (double e : analysis.blockEntropy) {
+            out << separator << e;
+            separator = " ";
+        }
+        out << "\n";
+    } else {
+        out << "{\"input\": " << jsonString(input) << ", \"size\": " << analysis.size
+            << ", \"unique_bytes\": " << analysis.uniqueBytes << ", \"entropy\": " << analysis.entropy
+            << ", \"conditional_entropy\": " << analysis.conditionalEntropy
+            << ", \"predicted_size\": " << analysis.predictedSize << ", \"block_size\": " << analysis.blockSize
+            << ", \"seconds\": " << seconds << ", \"throughput_mbps\": " << throughput << ", \"block_entropy\": [";
+        for (double e : analysis.blockEntropy) {
+            out << separator << e;
+            separator = ", ";
+        }
+        out << "]}\n";
+    }
+    cout << out.str() << flush;
+}
+
+// An archive's directory: a table as text, else one row per member
+void printArchiveMembers(const vector<ArchiveMember>& members, const string& format) {
+    ostringstream out;
+    if (format == "csv") out << "name,size,crc32c,extents\n";
+    else if (format == "json") out << "[";
+    else out << BOLD << setw(14) << "Size" << setw(10) << "CRC-32C" << setw(9) << "Extents" << "  Name" << RESET << "\n";
+    
+    uint64_t total = 0;
+    for (size_t i = 0; i < members.size(); i++) {
+        const ArchiveMember& member = members[i];
+        char crc[9];
+        snprintf(crc, sizeof(crc), "%08x", member.crc);
+        total += member.size;
+        if (format == "csv") {
+            out << csvField(member.name) << "," << member.size << "," << crc << "," << member.extents.size() << "\n";
+        } else if (format == "json") {
+            out << (i ? "," : "") << "\n  {\"name\": " << jsonString(member.name) << ", \"size\": " << member.size
+                << ", \"crc32c\": \"" << crc << "\", \"extents\": " << member.extents.size() << "}";
+        } else {
+            out << setw(14) << member.size << setw(10) << crc << setw(9) << member.extents.size() << "  " << member.name
+                << "\n";
+        }
+    }
+    if (format == "json") out << "\n]\n";
+    else if (format != "csv") out << setw(14) << total << "  " << members.size() << " members\n";
+    cout << out.str() << flush;
+}
+
+struct BenchInput {
+    string name;
+    vector<uint8_t> data;
+};
+
+struct BenchResult {
+    string name;
+    size_t size = 0;
+    size_t compressedSize = 0;
+    int trials = 0;
+    double compressP50 = 0, compressP99 = 0;
+    double decompressP50 = 0, decompressP99 = 0;
+    StageTimes compressStages;  // per trial
+    StageTimes decompressStages;
+};
+
+// ru_maxrss is the high-water mark of the whole process: it covers every
+// dataset run so far and never goes down, so it is reported once per bench
+long peakRssKb() {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+double percentile(vector<double> samples, double p) {
+    sort(samples.begin(), samples.end());
+    return samples[min(samples.size() - 1, (size_t)(p * samples.size()))];
+}
+
+// Deterministic inputs covering the shapes the coder meets in practice;
+// the small ones are there for per-call latency
+vector<BenchInput> benchCorpus(FileCompressor& compressor) {
+    const size_t large = 8 << 20;
+    mt19937 rng(20240611);
+    vector<BenchInput> corpus;
+    
+    vector<string> words;
+    for (int i = 0; i < 64; i++) {
+        string word;
+        for (size_t n = 2 + rng() % 8; word.size() < n;) word += (char)('a' + rng() % 26);
+        words.push_back(word);
+    }
+    BenchInput text{"text", {}};
+    while (text.data.size() < large) {
+        const string& word = words[min(rng() % 64, rng() % 64)];
+        text.data.insert(text.data.end(), word.begin(), word.end());
+        text.data.push_back(rng() % 12 ? ' ' : '\n');
+    }
+    text.data.resize(large);
+    
+    // Fixed-size records with a counter, a small value and a flag
+    BenchInput binary{"binary", {}};
+    for (uint32_t i = 0; binary.data.size() < large; i++) {
+        vector<uint8_t> record;
+        putU32(record, i * 37);
+        uint16_t value = (uint16_t)(rng() % 1000);
+        record.insert(record.end(), {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(rng() % 4), 0});
+        binary.data.insert(binary.data.end(), record.begin(), record.end());
+    }
+    binary.data.resize(large);
+    
+    BenchInput compressed{"compressed", {}};
+    compressor.compress(text.data.data(), text.data.size(), compressed.data);
+    
+    BenchInput random{"random", vector<uint8_t>(large)};
+    for (auto& byte : random.data) byte = (uint8_t)rng();
+    
+    corpus.push_back(text);
+    corpus.push_back(binary);
+    corpus.push_back(compressed);
+    corpus.push_back(BenchInput{"single-symbol", vector<uint8_t>(large, 'A')});
+    corpus.push_back(move(random));
+    corpus.push_back(BenchInput{"small-text", vector<uint8_t>(text.data.begin(), text.data.begin() + 4096)});
+    corpus.push_back(BenchInput{"small-binary", vector<uint8_t>(binary.data.begin(), binary.data.begin() + 4096)});
+    
+    // RPC-sized messages: a JSON body and a run of log lines
+    string json = "{\"items\":[";
+    for (int i = 0; json.size() < 900; i++) {
+        json += (i ? ",{\"id\":" : "{\"id\":") + to_string(rng() % 100000) + ",\"name\":\"" + words[rng() % 64] +
+                "\",\"price\":" + to_string(rng() % 1000) + "." + to_string(rng() % 100) + ",\"active\":" +
+                (rng() % 2 ? "true" : "false") + "}";
+    }
+    json += "],\"status\":\"ok\"}";
+    corpus.push_back(BenchInput{"small-json", vector<uint8_t>(json.begin(), json.end())});
+    
+    string log;
+    const char* levels[] = {"INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    for (int i = 0; log.size() < 2048; i++) {
+        char line[160];
+        snprintf(line, sizeof(line), "2024-06-11T10:%02d:%02d.%03dZ %-5s [worker-%d] %s request_id=%08x took %ums\n",
+                 i / 60 % 60, i % 60, (int)(rng() % 1000), levels[rng() % 5], (int)(rng() % 8),
+                 words[rng() % 64].c_str(), (unsigned)rng(), (unsigned)(rng() % 500));
+        log += line;
+    }
+    corpus.push_back(BenchInput{"small-log", vector<uint8_t>(log.begin(), log.end())});
+    return corpus;
+}
+
+// Warmup runs first, then timed round trips. Small inputs get more trials
+// (up to 1000) so their latency percentiles mean something. With small set
+// the round trips go through compressSmall() instead of the HUF2 buffer API.
+bool benchInput(FileCompressor& compressor, const BenchInput& input, int iterations, int warmup, bool small,
+                BenchResult& result) {
+    int trials = max(iterations, (int)min<size_t>(1000, (64 << 20) / max(input.data.size(), (size_t)1)));
+    vector<double> compressTimes, decompressTimes;
+    
+    // The buffers keep their capacity between trials, so growth is not measured
+    vector<uint8_t> packed, unpacked;
+    packed.reserve(input.data.size() + input.data.size() / 8 + 4096);
+    unpacked.reserve(input.data.size());
+    if (small) {
+        packed.resize(FileCompressor::compressSmallBound(input.data.size()));
+        unpacked.resize(input.data.size());
+    }
+    
+    result.name = input.name;
+    result.size = input.data.size();
+    result.trials = trials;
+    
+    for (int i = 0; i < warmup + trials; i++) {
+        CompressionStats stats = CompressionStats();
+        CompressionStats decoded = CompressionStats();
+        double decompressTime;
+        bool ok;
+        if (small) {
+            auto start = high_resolution_clock::now();
+            stats.compressedSize = FileCompressor::compressSmall(input.data.data(), input.data.size(), packed.data(),
+                                                                 packed.size());
+            auto coded = high_resolution_clock::now();
+            size_t written = 0;
+            ok = FileCompressor::decompressSmall(packed.data(), stats.compressedSize, unpacked.data(), unpacked.size(),
+                                                 written) && written == input.data.size();
+            stats.processingTime = coded - start;
+            decompressTime = duration_cast<duration<double>>(high_resolution_clock::now() - coded).count();
+        } else {
+            stats = compressor.compress(input.data.data(), input.data.size(), packed);
+            auto start = high_resolution_clock::now();
+            ok = compressor.decompress(packed.data(), packed.size(), unpacked, &decoded);
+            decompressTime = duration_cast<duration<double>>(high_resolution_clock::now() - start).count();
+        }
+        
+        if (i == 0 && (!ok || unpacked != input.data)) {
+            cerr << "Error: Round trip failed for " << input.name << endl;
+            return false;
+        }
+        if (i < warmup) continue;
+        
+        compressTimes.push_back(stats.processingTime.count());
+        decompressTimes.push_back(decompressTime);
+        result.compressStages += stats.stages;
+        result.decompressStages += decoded.stages;
+        result.compressedSize = stats.compressedSize;
+    }
+    
+    result.compressP50 = percentile(compressTimes, 0.50);
+    result.compressP99 = percentile(compressTimes, 0.99);
+    result.decompressP50 = percentile(decompressTimes, 0.50);
+    result.decompressP99 = percentile(decompressTimes, 0.99);
+    result.compressStages /= trials;
+    result.decompressStages /= trials;
+    return true;
+}
+
+void printBenchResults(const vector<BenchResult>& results, const string& format) {
+    ostringstream out;
+    auto mbps = [](size_t bytes, double seconds) { return seconds > 0 ? bytes / seconds / 1e6 : 0; };
+    
+    if (format == "text") {
+        out << BOLD << left << setw(16) << "dataset" << right << setw(10) << "size" << setw(8) << "ratio"
+            << setw(11) << "comp MB/s" << setw(13) << "decomp MB/s" << setw(22) << "comp p50/p99 us"
+            << setw(22) << "decomp p50/p99 us" << RESET << "\n";
+        for (const BenchResult& r : results) {
+            out << left << setw(16) << r.name << right << setw(10) << r.size << fixed << setprecision(3)
+                << setw(8) << (double)r.compressedSize / max(r.size, (size_t)1) << setprecision(1)
+                << setw(11) << mbps(r.size, r.compressP50) << setw(13) << mbps(r.size, r.decompressP50)
+                << setw(11) << r.compressP50 * 1e6 << setw(11) << r.compressP99 * 1e6
+                << setw(11) << r.decompressP50 * 1e6 << setw(11) << r.decompressP99 * 1e6 << "\n";
+            // Stages that did not run in a direction stay zero and are left
+            // out, and so is a direction with none (small-message runs)
+            for (const auto& direction : {make_pair("compress", &r.compressStages), make_pair("decompress", &r.decompressStages)}) {
+                bool any = false;
+                direction.second->forEach([&](const char*, uint64_t ns) { any = any || ns; });
+                if (!any) continue;
+                out << "    " << direction.first << " us/run:";
+                direction.second->forEach([&](const char* name, uint64_t ns) {
+                    if (ns) out << " " << name << " " << ns / 1e3;
+                });
+                out << "\n";
+            }
+        }
+        out << "Process peak RSS: " << peakRssKb() << " KB\n";
+    } else if (format == "csv") {
+        out << "dataset,size,compressed_size,trials,compress_mbps,decompress_mbps,compress_p50_ns,compress_p99_ns,"
+               "decompress_p50_ns,decompress_p99_ns";
+        StageTimes().forEach([&](const char* name, uint64_t) { out << ",compress_" << name << "_ns"; });
+        StageTimes().forEach([&](const char* name, uint64_t) { out << ",decompress_" << name << "_ns"; });
+        out << "\n";
+        for (const BenchResult& r : results) {
+            out << csvField(r.name) << "," << r.size << "," << r.compressedSize << "," << r.trials << fixed << setprecision(3)
+                << "," << mbps(r.size, r.compressP50) << "," << mbps(r.size, r.decompressP50) << setprecision(0)
+                << "," << r.compressP50 * 1e9 << "," << r.compressP99 * 1e9
+                << "," << r.decompressP50 * 1e9 << "," << r.decompressP99 * 1e9;
+            auto field = [&](const char*, uint64_t ns) { out << "," << ns; };
+            r.compressStages.forEach(field);
+            r.decompressStages.forEach(field);
+            out << "\n";
+        }
+    } else {
+        out << "{\"process_peak_rss_kb\": " << peakRssKb() << ", \"datasets\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchResult& r = results[i];
+            out << (i ? "," : "") << "\n  {\"dataset\": " << jsonString(r.name) << ", \"size\": " << r.size
+                << ", \"compressed_size\": " << r.compressedSize << ", \"trials\": " << r.trials << fixed << setprecision(3)
+                << ", \"compress_mbps\": " << mbps(r.size, r.compressP50)
+                << ", \"decompress_mbps\": " << mbps(r.size, r.decompressP50) << setprecision(0)
+                << ", \"compress_p50_ns\": " << r.compressP50 * 1e9 << ", \"compress_p99_ns\": " << r.compressP99 * 1e9
+                << ", \"decompress_p50_ns\": " << r.decompressP50 * 1e9 << ", \"decompress_p99_ns\": " << r.decompressP99 * 1e9;
+            const char* separator = ", \"compress_stages_ns\": {";
+            auto field = [&](const char* name, uint64_t ns) {
+                out << separator << "\"" << name << "\": " << ns;
+                separator = ", ";
+            };
+            r.compressStages.forEach(field);
+            separator = "}, \"decompress_stages_ns\": {";
+            r.decompressStages.forEach(field);
+            out << "}}";
+        }
+        out << "\n]}\n";
+    }
+    cout << out.str() << flush;
+}
+
+// Benchmarks the given files, or the built-in corpus when none are given.
+// Small-message mode is for messages of a few KB: larger files are refused
+// and only the small-* corpus entries run.
+int runBench(FileCompressor& compressor, const CommandLine& cmd) {
+    const size_t smallLimit = 64 << 10;
+    vector<BenchInput> inputs;
+    for (const string& file : cmd.inputs) {
+        ifstream in(file, ios::binary);
+        if (!in) {
+            cerr << "Error: Cannot open " << file << endl;
+            return 1;
+        }
+        inputs.push_back(BenchInput{file, vector<uint8_t>(istreambuf_iterator<char>(in), istreambuf_iterator<char>())});
+        if (cmd.small && inputs.back().data.size() > smallLimit) {
+            cerr << "Error: " << file << " is too large for --small (over " << (smallLimit >> 10) << " KB)" << endl;
+            return 1;
+        }
+    }
+    if (inputs.empty()) {
+        inputs = benchCorpus(compressor);
+        if (cmd.small) {
+            inputs.erase(remove_if(inputs.begin(), inputs.end(),
+                                   [&](const BenchInput& input) { return input.data.size() > smallLimit; }),
+                         inputs.end());
+        }
+    }
+    
+    vector<BenchResult> results;
+    for (const BenchInput& input : inputs) {
+        BenchResult result;
+        if (!benchInput(compressor, input, cmd.iterations, cmd.warmup, cmd.small, result)) return 1;
+        results.push_back(result);
+    }
+    
+    printBenchResults(results, cmd.format);
+    return 0;
+}
+
+// Non-interactive entry point for scripts: file_compressor <command> ...
+int runCommandLine(int argc, char** argv) {
+    CommandLine cmd;
+    if (!parseCommandLine(argc, argv, cmd)) {
+        displayUsage();
+        return 2;
+    }
+    
+    FileCompressor compressor;
+    compressor.setQuiet(cmd.quiet || cmd.format != "text" || cmd.command == "bench");
+    if (cmd.threads) compressor.setThreads(cmd.threads);
+    if (cmd.blockSize) compressor.setBlockSize(cmd.blockSize);
+    compressor.setLevel(cmd.level);
+    compressor.setEntropyCoder(cmd.coder);
+    compressor.setSplitStreams(cmd.streams == 4);
+    if (cmd.maxCodeLength) compressor.setMaxCodeLength(cmd.maxCodeLength);
+    if (cmd.sampleLoss >= 0) compressor.setSampling(cmd.sampleRate, cmd.sampleLoss);
+    else compressor.setSampling(cmd.sampleRate);
+    if (!cmd.table.empty() && !compressor.loadTable(cmd.table)) return 1;
+    
+    if (cmd.command == "bench") return runBench(compressor, cmd);
+    
+    vector<StatsRow> rows;
+    int status = 0;
+    const string& input = cmd.inputs[0];
+    
+    if (cmd.command == "compress") {
+        string output = cmd.output.empty() ? input + ".huf" : cmd.output;
+        CompressionStats stats = compressor.compress(input, output);
+        if (!stats.error.empty()) return 1;
+        if (cmd.format == "text" && !cmd.quiet) compressor.displayStats(stats);
+        rows.push_back({"compress", input, output, stats});
+    } else if (cmd.command == "decompress") {
+        string output = cmd.output;
+        if (output.empty()) {
+            bool huf = input.size() > 4 && input.compare(input.size() - 4, 4, ".huf") == 0;
+            output = huf ? input.substr(0, input.size() - 4) : input + ".out";
+        }
+        CompressionStats stats = CompressionStats();
+        if (!compressor.decompress(input, output, &stats)) return 1;
+        rows.push_back({"decompress", input, output, stats});
+    } else if (cmd.command == "train") {
+        return compressor.trainTable(cmd.inputs, cmd.output.empty() ? "table.huft" : cmd.output) ? 0 : 1;
+    } else if (cmd.command == "extract") {
+        string output = cmd.output.empty() ? input + ".part" : cmd.output;
+        CompressionStats stats = CompressionStats();
+        if (!compressor.decompressRange(input, output, cmd.offset, cmd.length, &stats)) return 1;
+        rows.push_back({"extract", input, output, stats});
+    } else if (cmd.command == "analyze") {
+        if (!fileExists(input)) {
+            cerr << "Error: File not found!" << endl;
+            return 1;
+        }
+        FileAnalysis analysis;
+        if (!compressor.analyze(input, analysis)) return 1;
+        if (cmd.format != "text") printAnalysis(input, analysis, cmd.format);
+        else if (!cmd.quiet) compressor.displayAnalysis(input, analysis);
+        return 0;
+    } else if (cmd.command == "batch" && (cmd.archive || cmd.dedup)) {
+        string output = cmd.output.empty() ? "batch.hufa" : cmd.output;
+        compressor.setDedup(cmd.dedup);
+        CompressionStats stats = compressor.compressArchive(cmd.inputs, output);
+        if (!stats.compressedSize) return 1;
+        rows.push_back({"archive", to_string(cmd.inputs.size()) + " files", output, stats});
+    } else if (cmd.command == "unpack") {
+        string outputDir = cmd.output.empty() ? "." : cmd.output;
+        vector<string> members(cmd.inputs.begin() + 1, cmd.inputs.end());
+        CompressionStats stats = CompressionStats();
+        if (!compressor.extractArchive(input, outputDir, members, &stats)) return 1;
+        rows.push_back({"unpack", input, outputDir, stats});
+    } else if (cmd.command == "list") {
+        vector<ArchiveMember> members;
+        if (!compressor.listArchive(input, members)) return 1;
+        printArchiveMembers(members, cmd.format);
+        return 0;
+    } else if (cmd.command == "batch") {
+        string outputDir = cmd.output.empty() ? "compressed" : cmd.output;
+        vector<CompressionStats> allStats = compressor.batchCompress(cmd.inputs, outputDir);
+        vector<string> outputs = batchOutputPaths(cmd.inputs, outputDir);
+        for (size_t i = 0; i < cmd.inputs.size(); i++) {
+            if (!allStats[i].error.empty()) status = 1;
+            rows.push_back({"batch", cmd.inputs[i], outputs[i], allStats[i]});
+        }
+    } else {
+        displayUsage();
+        return 2;
+    }
+    
+    if (cmd.format != "text") printStatsRows(rows, cmd.format);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) return runCommandLine(argc, argv);
+    
     FileCompressor compressor;
     int choice;
     string inputFile, outputFile;
@@ -574,7 +5714,7 @@ int main() {
                 
                 FileCompressor analyzer;
                 analyzer.toggleProgress(false);
-                // Call a method to analyze the file
+                analyzer.analyze(inputFile);
                 break;
             }
             